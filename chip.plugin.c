@@ -6,402 +6,5440 @@
 // The code is based heavily on ideas from https://gist.github.com/yoursunny/b89f86c9f5911cea322f3047ff99c576
 //
 // Installation:
-//   gcc -o chip.plugin chip.plugin.c
+//   gcc -O3 -pthread -o chip.plugin chip.plugin.c
 //   cp chip.plugin /usr/libexec/netdata/plugins.d/
+// On the CHIP itself, adding -mfpu=neon (ARMv7 only) lets the query scans
+// use NEON.
 //
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <memory.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
+#include <linux/netlink.h>
+
+#ifdef CHIP_BENCHMARK
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+#endif
+
+//
+// Register map of the AXP209 sensor dimensions, one row per dimension. Each
+// row describes how the dimension is decoded from the register shadow:
+//
+//   Reg, LowBits  The field's high bits live in Reg. If LowBits is non-zero,
+//                 the field continues with the low LowBits bits of Reg + 1
+//                 (e.g. 12-bit ADC values are 8 high bits + a low nibble).
+//   Shift, Mask   The field is then shifted right and masked.
+//   Mul, Off, Div Scaling: value = (field * Mul + Off) / Div. Only the integer
+//                 field * Mul + Off is computed and emitted; the division is
+//                 left to netdata through the DIMENSION divisor, which keeps
+//                 float math and formatting out of the collection path.
+//   Base          If not EMPTY_DIM, the scaled integer is additionally
+//                 multiplied by the integer of the Base dimension (used for
+//                 percentages). Div must then include the Base's divisor.
+//   VReg, VMask,  The dimension is valid when (VReg & VMask) != VReject, e.g.
+//   VReject       when a power status bit is set. ALWAYS_VALID never rejects.
+//   Period        Tick for values read every update, or Config for PMIC
+//                 configuration that only changes when someone reprograms it,
+//                 which is cached and refreshed every gConfigEvery seconds.
+//
+// Adding a sensor only requires a new row here and a chart that uses it.
+//
+
+#define ALWAYS_VALID 0x00, 0x00, 0x01
+
+#define SENSOR_DIMENSIONS(X) \
+    /* Name             Properties                               Reg   LowBits Shift Mask    Mul   Off     Div  Base         VReg  VMask VReject Period */ \
+    X(internaltemp,     "\"Internal Temp\" absolute",            0x5E, 4,      0,    0x0FFF, 18,   -22846, 100, EMPTY_DIM,   ALWAYS_VALID,     Tick  ) \
+    X(batlevel,         "\"Charge\" absolute",                   0xB9, 0,      0,    0x007F, 1,    0,      1,   EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(chargelimit,      "\"Charge Limit\" absolute",             0x33, 0,      0,    0x000F, 100,  300,    1,   EMPTY_DIM,   0x33, 0x80, 0x00, Config) \
+    X(chargeterm,       "\"Charge Termination Limit\" absolute", 0x33, 0,      4,    0x0001, 5,    10,     100, chargelimit, 0x33, 0x80, 0x00, Config) \
+    X(batcharge,        "\"Batt Charge\" absolute",              0x7A, 4,      0,    0x0FFF, 1,    0,      2,   EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(batdischarge,     "\"Batt Discharge\" absolute",           0x7C, 5,      0,    0x1FFF, 1,    0,      1,   EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(batvoltage,       "\"Voltage\" absolute",                  0x78, 4,      0,    0x0FFF, 11,   0,      10,  EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(acinvoltage,      "\"Voltage\" absolute",                  0x56, 4,      0,    0x0FFF, 17,   0,      10,  EMPTY_DIM,   0x01, 0x80, 0x00, Tick  ) \
+    X(acincurrent,      "\"Current\" absolute",                  0x58, 4,      0,    0x0FFF, 5,    0,      8,   EMPTY_DIM,   0x01, 0x80, 0x00, Tick  ) \
+    X(vbusvoltage,      "\"Voltage\" absolute",                  0x5A, 4,      0,    0x0FFF, 17,   0,      10,  EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(vbusvoltagelimit, "\"Limit\" absolute",                    0x30, 0,      3,    0x0007, 100,  4000,   1,   EMPTY_DIM,   0x30, 0x40, 0x00, Config) \
+    X(vbuscurrent,      "\"Current\" absolute",                  0x5C, 4,      0,    0x0FFF, 3,    0,      8,   EMPTY_DIM,   0x01, 0x20, 0x00, Tick  ) \
+    X(vbuscurrentlimit, "\"Limit\" absolute",                    0x30, 0,      0,    0x0003, -400, 900,    1,   EMPTY_DIM,   0x30, 0x03, 0x03, Config)
+
+//
+// Sensor dimensions that are aggregated when oversampling. Each contributes
+// a <name>min and <name>max dimension, while the dimension itself reports the
+// average of the samples taken during the interval.
+//
+
+#define OVERSAMPLED_DIMENSIONS(X) \
+    X(batcharge,   "Batt Charge")      \
+    X(batdischarge, "Batt Discharge")  \
+    X(batvoltage,  "Voltage")          \
+    X(acinvoltage, "Voltage")          \
+    X(acincurrent, "Current")          \
+    X(vbusvoltage, "Voltage")          \
+    X(vbuscurrent, "Current")
+
+//
+// Dimensions describing the plugin itself. They are not decoded from
+// registers but computed while collecting.
+//
+
+#define PLUGIN_DIMENSIONS(X) \
+    /* Name             Properties                           Div   */ \
+    X(i2csyscalls,      "\"Syscalls\" absolute",             1)     \
+    X(i2ctransfers,     "\"Transfers\" absolute",            1)     \
+    X(i2cbytes,         "\"Bytes\" absolute",                1)     \
+    X(i2cerrors,        "\"Errors\" incremental",            1)     \
+    X(i2cretries,       "\"Retries\" incremental",           1)     \
+    X(i2creopens,       "\"Reopens\" incremental",           1)     \
+    X(i2clatencyp50,    "\"p50\" absolute",                  1000)  \
+    X(i2clatencyp99,    "\"p99\" absolute",                  1000)  \
+    X(i2clatencymax,    "\"Max\" absolute",                  1000)  \
+    X(gathertimeus,     "\"Gather\" absolute",               1)     \
+    X(emittimeus,       "\"Emit\" absolute",                 1)     \
+    X(cpuusage,         "\"CPU\" absolute",                  10000) \
+    X(latenessus,       "\"Lateness\" absolute",             1)     \
+    X(jitterus,         "\"Jitter\" absolute",               1)     \
+    X(skippedticks,     "\"Skipped\" incremental",           1)     \
+    X(droppedframes,    "\"Dropped\" incremental",           1)
+
+//
+// Power events latched by the AXP209 in its IRQ status registers, counted
+// while collecting. Reconfiguring events are the ones after which the kernel
+// may reprogram the charge and VBUS limits.
+//
+
+#define POWER_EVENTS(X) \
+    /* Name             Properties                           Reg   Mask  Reconfiguring */ \
+    X(acinplugged,      "\"ACIN In\" incremental",            0x48, 0x40, true)  \
+    X(acinremoved,      "\"ACIN Out\" incremental",           0x48, 0x20, true)  \
+    X(vbusplugged,      "\"VBUS In\" incremental",            0x48, 0x08, true)  \
+    X(vbusremoved,      "\"VBUS Out\" incremental",           0x48, 0x04, true)  \
+    X(batplugged,       "\"Battery In\" incremental",         0x49, 0x80, true)  \
+    X(batremoved,       "\"Battery Out\" incremental",        0x49, 0x40, true)  \
+    X(chargestarted,    "\"Charge Start\" incremental",       0x49, 0x08, false) \
+    X(chargedone,       "\"Charge Done\" incremental",        0x49, 0x04, false)
 
 //
 // Enumeration of all possible dimensions. Each dimension is mapped as an x-
 // value for a chart.
 //
 
-enum Dimensions
+#define DIMENSION_ENUM(name, ...) name,
+#define DIMENSION_COUNT(name, ...) + 1
+#define AGGREGATE_ENUM(name, label) name##min, name##max,
+
+enum Dimensions
+{
+    SENSOR_DIMENSIONS(DIMENSION_ENUM)
+    OVERSAMPLED_DIMENSIONS(AGGREGATE_ENUM)
+    PLUGIN_DIMENSIONS(DIMENSION_ENUM)
+    POWER_EVENTS(DIMENSION_ENUM)
+
+    MaxDimensions
+};
+
+#define NUM_SENSOR_DIMENSIONS (0 SENSOR_DIMENSIONS(DIMENSION_COUNT))
+#define NUM_OVERSAMPLED_DIMENSIONS (0 OVERSAMPLED_DIMENSIONS(DIMENSION_COUNT))
+#define NUM_POWER_EVENTS (0 POWER_EVENTS(DIMENSION_COUNT))
+#define EMPTY_DIM MaxDimensions
+#define DIMENSION_BIT(index) ((uint64_t)1 << (index))
+
+_Static_assert(MaxDimensions <= 64, "Dimensions do not fit into the validity bitmask");
+
+enum CollectionPeriod
+{
+    Tick,
+    Config
+};
+
+#define SENSOR_DIVISOR(name, properties, reg, lowbits, shift, mask, mul, off, div, ...) name##Divisor = div,
+
+enum SensorDivisors
+{
+    SENSOR_DIMENSIONS(SENSOR_DIVISOR)
+};
+
+#define SENSOR_DEFINITION(name, properties, reg, lowbits, shift, mask, mul, off, div, ...) { #name, properties, div },
+#define AGGREGATE_DEFINITION(name, label) \
+    { #name "min", "\"" label " Min\" absolute", name##Divisor }, \
+    { #name "max", "\"" label " Max\" absolute", name##Divisor },
+#define PLUGIN_DEFINITION(name, properties, div) { #name, properties, div },
+#define POWER_EVENT_DEFINITION(name, properties, ...) { #name, properties, 1 },
+
+struct
+{
+    char * Name;
+    char * Properties;
+    int32_t Divisor;
+} const gDimensionDefinitions[MaxDimensions] = {
+    SENSOR_DIMENSIONS(SENSOR_DEFINITION)
+    OVERSAMPLED_DIMENSIONS(AGGREGATE_DEFINITION)
+    PLUGIN_DIMENSIONS(PLUGIN_DEFINITION)
+    POWER_EVENTS(POWER_EVENT_DEFINITION)
+};
+
+struct register_field
+{
+    enum Dimensions Dimension;
+    uint8_t Register;
+    uint8_t LowBits;
+    uint8_t Shift;
+    uint16_t Mask;
+    int32_t Multiplier;
+    int32_t Offset;
+    int32_t Divisor;
+    enum Dimensions Base;
+    uint8_t ValidRegister;
+    uint8_t ValidMask;
+    uint8_t ValidReject;
+    enum CollectionPeriod Period;
+};
+
+#define REGISTER_FIELD(name, properties, ...) { name, __VA_ARGS__ },
+
+const struct register_field gRegisterMap[NUM_SENSOR_DIMENSIONS] = {
+    SENSOR_DIMENSIONS(REGISTER_FIELD)
+};
+
+//
+// Charts and their dimensions. A chart's dimension list ends at the first
+// EMPTY_DIM, unless it is full.
+//
+
+#define MAX_CHART_DIMENSIONS 8
+
+struct
+{
+    char * Name;
+    char * Properties;
+    enum Dimensions Dimensions[MAX_CHART_DIMENSIONS];
+} const gChartDefinitions[] = {
+    { "Chip.temps", "\"\" \"Temperature\" \"Degrees (F)\"", { internaltemp, EMPTY_DIM } },
+    { "Chip.batterylevel", "\"\" \"Battery Level\" \"%\"", { batlevel, EMPTY_DIM } },
+    { "Chip.batterycurrent", "\"\" \"Battery Current\" \"mA\"", { chargelimit, chargeterm, batcharge, batdischarge, batchargemin, batchargemax, batdischargemin, batdischargemax } },
+    { "Chip.batteryvoltage", "\"\" \"Battery Voltage\" \"mV\"", { batvoltage, batvoltagemin, batvoltagemax, EMPTY_DIM } },
+    { "Chip.acinvoltage", "\"\" \"ACIN Voltage\" \"mV\"", { acinvoltage, acinvoltagemin, acinvoltagemax, EMPTY_DIM } },
+    { "Chip.acincurrent", "\"\" \"ACIN Current\" \"mA\"", { acincurrent, acincurrentmin, acincurrentmax, EMPTY_DIM } },
+    { "Chip.vbusvoltage", "\"\" \"VBUS Voltage\" \"mV\"", { vbusvoltage, vbusvoltagelimit, vbusvoltagemin, vbusvoltagemax, EMPTY_DIM } },
+    { "Chip.vbuscurrent", "\"\" \"VBUS Current\" \"mA\"", { vbuscurrent, vbuscurrentlimit, vbuscurrentmin, vbuscurrentmax, EMPTY_DIM } },
+    { "Chip.power_events", "\"\" \"Power Events\" \"events/s\"", { acinplugged, acinremoved, vbusplugged, vbusremoved, batplugged, batremoved, chargestarted, chargedone } },
+    { "Chip.plugin_i2c", "\"\" \"Plugin I2C Usage\" \"operations/tick\"", { i2csyscalls, i2ctransfers, EMPTY_DIM } },
+    { "Chip.plugin_i2c_bytes", "\"\" \"Plugin I2C Traffic\" \"bytes/tick\"", { i2cbytes, EMPTY_DIM } },
+    { "Chip.plugin_i2c_errors", "\"\" \"Plugin I2C Errors\" \"events/s\"", { i2cerrors, i2cretries, i2creopens, EMPTY_DIM } },
+    { "Chip.plugin_i2c_latency", "\"\" \"Plugin I2C Transaction Latency\" \"microseconds\"", { i2clatencyp50, i2clatencyp99, i2clatencymax, EMPTY_DIM } },
+    { "Chip.plugin_time", "\"\" \"Plugin Collection Time\" \"microseconds\"", { gathertimeus, emittimeus, EMPTY_DIM } },
+    { "Chip.plugin_cpu", "\"\" \"Plugin CPU Usage\" \"percentage\"", { cpuusage, EMPTY_DIM } },
+    { "Chip.plugin_scheduling", "\"\" \"Plugin Tick Lateness\" \"microseconds\"", { latenessus, jitterus, EMPTY_DIM } },
+    { "Chip.plugin_overruns", "\"\" \"Plugin Skipped Ticks\" \"ticks/s\"", { skippedticks, EMPTY_DIM } },
+    { "Chip.plugin_dropped", "\"\" \"Plugin Dropped Frames\" \"frames/s\"", { droppedframes, EMPTY_DIM } },
+};
+
+#define NUM_CHARTS (sizeof(gChartDefinitions) / sizeof(gChartDefinitions[0]))
+
+//
+// Charts selected by the operator (all by default), and the dimensions they
+// contain as a bitmask.
+//
+
+bool gChartEnabled[NUM_CHARTS];
+uint64_t gEnabledDimensions;
+
+//
+// C.H.I.P. hardware-specific constants.
+//
+
+#define I2C_DEVICE "i2c-0"
+#define AXP209_ADDRESS 0x34
+#define AXP209_DRIVER "/sys/bus/i2c/devices/0-0034/driver"
+#define I2C_TRANSACTION_TIMEOUT 2   // In units of 10 ms
+#define I2C_ADAPTER_RETRIES 1
+
+//
+// Values are collected from the AXP209 registers over I2C, or from the
+// kernel's axp20x drivers through sysfs when they are loaded.
+//
+
+enum CollectionBackend
+{
+    BackendAuto,
+    BackendI2c,
+    BackendSysfs
+};
+
+enum CollectionBackend gBackend = BackendAuto;
+
+int gI2c = -1;
+uint16_t gUpdateEvery;
+uint16_t gOversampleRate;
+uint16_t gConfigEvery = 60;
+
+//
+// Shadow copy of the AXP209 register file, indexed by address. The registers
+// needed by the enabled dimensions are refreshed according to read plans built
+// by plan_reads(): a plan covers its registers with auto-incrementing burst
+// reads, one write-address/read-N-bytes message pair per range, all submitted
+// together in a single I2C_RDWR ioctl. Since the high and low halves of each
+// ADC value arrive in the same burst, they can no longer tear when the ADC
+// updates between two separate reads.
+//
+// Registers separated by a gap of up to MAX_RANGE_GAP unneeded bytes are
+// coalesced into one burst, as clocking a few extra bytes is cheaper than
+// another address phase on the bus.
+//
+
+#define MAX_PLAN_RANGES (I2C_RDWR_IOCTL_MAX_MSGS / 2)
+#define MAX_RANGE_GAP 2
+
+struct read_plan
+{
+    uint64_t Dimensions;
+    uint8_t NumRanges;
+    struct
+    {
+        uint8_t Start;
+        uint8_t Length;
+    } Ranges[MAX_PLAN_RANGES];
+    struct i2c_msg Messages[MAX_PLAN_RANGES * 2];
+    uint16_t NumBytes;
+
+    // Rows of gRegisterMap decoded after the plan is read, densely packed in
+    // table order so that Base dimensions are decoded before the rows that
+    // use them.
+
+    uint8_t NumRows;
+    struct register_field Rows[NUM_SENSOR_DIMENSIONS];
+};
+
+uint8_t gShadow[256];
+
+//
+// The full plan refreshes every enabled dimension. The tick plan leaves out
+// the Config dimensions, whose cached values are reused until the full plan
+// runs again every gConfigTicks ticks, and the config plan reads only those.
+// The sample plan only covers the oversampled dimensions, and is read at
+// gOversampleRate Hz in between ticks when oversampling is enabled.
+//
+
+struct read_plan gFullPlan;
+struct read_plan gTickPlan;
+struct read_plan gConfigPlan;
+struct read_plan gSamplePlan;
+
+//
+// Configuration caching. Nothing signals a write to the configuration
+// registers, but the kernel power supply driver reprograms them when a power
+// source or the battery comes or goes. While caching, both plans that run on
+// ticks also read the IRQ status registers, and a reconfiguring power event
+// latched since the previous read rereads the config plan straight away. Only
+// scheduled ticks count down to the next full read, so out-of-cycle
+// collections for power events leave the config-every spacing alone.
+//
+
+uint16_t gConfigTicks;
+uint16_t gConfigCountdown;
+uint64_t gCachedDimensions;
+
+//
+// Power events. Newly latched IRQ status bits are counted on the power events
+// chart whenever a plan reads the status registers: on ticks while caching or
+// charting them, and gEventPollRate times a second with the event plan when
+// polling, where an event also triggers an out-of-cycle collection so the
+// change shows up at once. The status bits are write-1-to-clear. When a
+// kernel driver is bound to the AXP209, it owns them and clears them from its
+// interrupt handler, so they are only compared with the previous read. With
+// no driver bound, nothing else clears them: the power event bits found set
+// are written back so that the next plug or removal of the same kind latches
+// again. IRQ status registers 3-5 (0x4A-0x4C) hold no power events and are
+// not read.
+//
+// The sysfs backend has no IRQ status. Plugging and removal are counted from
+// the supplies' present attributes instead, and the kernel's power supply
+// uevents trigger the out-of-cycle collections.
+//
+
+#define IRQ_STATUS_1 0x48
+#define IRQ_STATUS_2 0x49
+#define MAX_EVENT_POLL_RATE 100
+
+#define POWER_EVENT_STATE(name, properties, reg, mask, reconfiguring) { name, reg, mask, reconfiguring, 0 },
+
+struct
+{
+    const enum Dimensions Dimension;
+    const uint8_t Register;
+    const uint8_t Mask;
+    const bool Reconfiguring;
+    uint32_t Count;
+} gPowerEvents[NUM_POWER_EVENTS] = {
+    POWER_EVENTS(POWER_EVENT_STATE)
+};
+
+const uint8_t gIrqStatusRegisters[] = { IRQ_STATUS_1, IRQ_STATUS_2 };
+
+void count_power_event(enum Dimensions dimension)
+{
+    uint8_t index;
+
+    for (index = 0; index < NUM_POWER_EVENTS; index++) {
+        if (gPowerEvents[index].Dimension == dimension) {
+            gPowerEvents[index].Count++;
+        }
+    }
+}
+
+struct read_plan gEventPlan;
+uint16_t gEventPollRate;
+bool gIrqStatusRead;
+bool gClearIrqStatus;
+uint8_t gLastIrqStatus[sizeof(gIrqStatusRegisters)];
+
+//
+// Oversampling. Between ticks, the sample plan is read and decoded at
+// gOversampleRate Hz and every valid reading of an oversampled dimension is
+// folded into a running sum, count, minimum and maximum, so memory stays
+// constant however many samples an interval holds. At the tick, which also
+// counts as a sample, the dimension reports the average and its min/max
+// dimensions the extremes, and the aggregates start over.
+//
+
+#define MAX_OVERSAMPLE_RATE 1000
+
+#define AGGREGATE_STATE(name, label) { name, name##min, name##max, 0, 0, 0, 0 },
+
+struct
+{
+    const enum Dimensions Source;
+    const enum Dimensions Min;
+    const enum Dimensions Max;
+    int64_t Sum;
+    uint32_t Count;
+    int32_t Minimum;
+    int32_t Maximum;
+} gAggregates[NUM_OVERSAMPLED_DIMENSIONS] = {
+    OVERSAMPLED_DIMENSIONS(AGGREGATE_STATE)
+};
+
+//
+// Number of I2C syscalls, bus transfers and bytes (address bytes included)
+// issued since the previous tick, and the number of failed bus transactions,
+// retries and bus reopens since startup.
+//
+// Bus errors do not end the plugin. A failed read is retried up to
+// MAX_BUS_ATTEMPTS times in all, backing off from BUS_BACKOFF_US and doubling,
+// so with the I2C_TIMEOUT on each transaction a tick is delayed by at most
+// 3 * 20 ms + 3 ms. When every attempt fails, the dimensions of the read stay
+// invalid for the tick, and after REOPEN_AFTER_FAILURES such reads in a row
+// the bus is closed and opened again. If that fails, the bus is down: ticks
+// read nothing, oversampling and event polling stop, and reopening is tried
+// again on the first tick after MIN_REOPEN_INTERVAL seconds, then at doubling
+// intervals of up to MAX_REOPEN_INTERVAL seconds, so that a dead bus costs
+// neither the event loop's time nor a flood of messages.
+//
+
+#define MAX_BUS_ATTEMPTS 3
+#define BUS_BACKOFF_US 1000
+#define REOPEN_AFTER_FAILURES 3
+#define MIN_REOPEN_INTERVAL 1
+#define MAX_REOPEN_INTERVAL 256
+
+uint32_t gSyscalls;
+uint32_t gTransfers;
+uint32_t gBytes;
+uint32_t gBusErrors;
+uint32_t gBusRetries;
+uint32_t gBusReopens;
+uint32_t gBusFailures;
+bool gBusDown;
+uint32_t gReopenInterval;
+uint64_t gNextReopen;
+
+//
+// After it is read from the I2C bus and processed, the data for each dimension
+// is stored in the gData array as a scaled integer and a bit is set in the
+// gIsValid bitmask to indicate that the data can be used.
+//
+
+int32_t gData[MaxDimensions];
+uint64_t gIsValid;
+
+void save_data(enum Dimensions index, int32_t value)
+{
+    gData[index] = value;
+    gIsValid |= DIMENSION_BIT(index);
+}
+
+bool is_dimension_valid(enum Dimensions index)
+{
+    return (gIsValid & DIMENSION_BIT(index)) != 0;
+}
+
+bool is_dimension_enabled(enum Dimensions index)
+{
+    return (gEnabledDimensions & DIMENSION_BIT(index)) != 0;
+}
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+//
+// Bus latency. Every transaction with the AXP209 is timed and counted into
+// two log-linear histograms in the style of HdrHistogram: one for the current
+// collection interval, charted as p50/p99/max and then cleared, and one since
+// startup, dumped to stderr on SIGUSR1. Each power of two of nanoseconds is
+// split into 2^LATENCY_SUB_BUCKET_BITS linear buckets, so a reported
+// percentile is within 12.5% of the true value; values below 2^3 ns, where
+// the split would go below 1 ns, get a bucket each. Latencies are capped at
+// INT32_MAX ns, a little over 2 s.
+//
+
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((31 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram
+{
+    uint32_t Counts[LATENCY_BUCKETS];
+    uint32_t Total;
+    uint32_t Maximum;
+};
+
+struct latency_histogram gIntervalLatency;
+struct latency_histogram gLifetimeLatency;
+
+uint16_t latency_bucket(uint32_t latency)
+{
+    uint8_t exponent;
+
+    if (latency < LATENCY_SUB_BUCKETS) {
+        return latency;
+    }
+
+    exponent = 31 - __builtin_clz(latency);
+
+    return ((exponent - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) +
+           ((latency >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+uint32_t latency_bucket_limit(uint16_t bucket)
+{
+    uint8_t shift;
+
+    // The highest latency that falls into the bucket.
+
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+
+    return (((uint64_t)(LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1))) + 1) << shift) - 1;
+}
+
+void add_latency(struct latency_histogram * histogram, uint32_t latency)
+{
+    histogram->Counts[latency_bucket(latency)]++;
+    histogram->Total++;
+
+    if (latency > histogram->Maximum) {
+        histogram->Maximum = latency;
+    }
+}
+
+void record_latency(uint64_t started)
+{
+    uint64_t latency = clock_ns(CLOCK_MONOTONIC) - started;
+
+    latency = latency < INT32_MAX ? latency : INT32_MAX;
+
+    add_latency(&gIntervalLatency, latency);
+    add_latency(&gLifetimeLatency, latency);
+}
+
+uint32_t latency_percentile(const struct latency_histogram * histogram, uint32_t permille)
+{
+    uint64_t target = ((uint64_t)histogram->Total * permille + 999) / 1000;
+    uint64_t count = 0;
+    uint16_t bucket;
+    uint32_t limit;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += histogram->Counts[bucket];
+        if (count >= target) {
+            break;
+        }
+    }
+
+    limit = latency_bucket_limit(bucket);
+    return limit < histogram->Maximum ? limit : histogram->Maximum;
+}
+
+//
+// Bus backends. Every access to the AXP209 goes through gBus, which is either
+// the i2c-dev device or an in-process simulation of the chip. Like the
+// syscalls they stand for, the operations return a negative value and set
+// errno on failure.
+//
+
+struct bus_backend
+{
+    const char * Name;
+    int (*Open)(void);
+    void (*Close)(void);
+    ssize_t (*Read)(uint8_t * buffer, size_t length);
+    ssize_t (*Write)(const uint8_t * buffer, size_t length);
+    int (*Transfer)(struct i2c_msg * messages, uint32_t count);
+};
+
+int i2c_open(void)
+{
+    gI2c = open("/dev/" I2C_DEVICE, O_RDWR | O_CLOEXEC);
+    if (gI2c < 0) {
+        return -1;
+    }
+
+    // Bound every transaction, so that a wedged bus costs a failed read
+    // rather than a stalled plugin. Not every adapter honours these.
+
+    ioctl(gI2c, I2C_TIMEOUT, I2C_TRANSACTION_TIMEOUT);
+    ioctl(gI2c, I2C_RETRIES, I2C_ADAPTER_RETRIES);
+
+    return ioctl(gI2c, I2C_SLAVE_FORCE, AXP209_ADDRESS);
+}
+
+void i2c_close(void)
+{
+    if (gI2c >= 0) {
+        close(gI2c);
+        gI2c = -1;
+    }
+}
+
+ssize_t i2c_read(uint8_t * buffer, size_t length)
+{
+    return read(gI2c, buffer, length);
+}
+
+ssize_t i2c_write(const uint8_t * buffer, size_t length)
+{
+    return write(gI2c, buffer, length);
+}
+
+int i2c_transfer(struct i2c_msg * messages, uint32_t count)
+{
+    struct i2c_rdwr_ioctl_data request = { messages, count };
+
+    return ioctl(gI2c, I2C_RDWR, &request);
+}
+
+const struct bus_backend gI2cBackend = { I2C_DEVICE, i2c_open, i2c_close, i2c_read, i2c_write, i2c_transfer };
+
+//
+// Simulated AXP209. The simulator holds a register file with an auto-
+// incrementing address pointer, as the chip does. Every transaction advances
+// the model by one step: the ADC registers follow slow triangle waves, and
+// every SIMULATED_POWER_PERIOD steps VBUS is plugged in or removed, which
+// switches the battery between charging and discharging and latches the
+// matching IRQ status bit. IRQ status bits are cleared by writing 1s to them.
+//
+// Faults are scripted as errno@step[*count], e.g. "EIO@100,ETIMEDOUT@250*3"
+// fails step 100 with EIO and steps 250-252 with ETIMEDOUT. Steps count from
+// 0 and failed transactions count as steps too, so a script replays exactly.
+//
+
+#define SIMULATED_POWER_PERIOD 1000
+#define MAX_SIMULATED_FAULTS 16
+
+struct simulated_fault
+{
+    uint32_t Step;
+    uint32_t Count;
+    int Error;
+};
+
+struct
+{
+    uint8_t Registers[256];
+    uint8_t Address;
+    uint32_t Step;
+    uint8_t NumFaults;
+    struct simulated_fault Faults[MAX_SIMULATED_FAULTS];
+} gSimulator;
+
+const struct
+{
+    const char * Name;
+    int Error;
+} gSimulatedErrors[] = {
+    { "EIO",       EIO },
+    { "ENXIO",     ENXIO },
+    { "EAGAIN",    EAGAIN },
+    { "ETIMEDOUT", ETIMEDOUT },
+    { "EREMOTEIO", EREMOTEIO },
+};
+
+int parse_simulated_faults(const char * script)
+{
+    char faults[256];
+    char * fault;
+    char * saveptr;
+    char * step;
+    char * count;
+    struct simulated_fault * target;
+    uint8_t errorindex;
+
+    gSimulator.NumFaults = 0;
+
+    if (script == NULL) {
+        return 0;
+    }
+
+    if (strlen(script) >= sizeof(faults)) {
+        return -1;
+    }
+
+    strcpy(faults, script);
+
+    for (fault = strtok_r(faults, ", ", &saveptr); fault != NULL; fault = strtok_r(NULL, ", ", &saveptr)) {
+        if (gSimulator.NumFaults == MAX_SIMULATED_FAULTS) {
+            fprintf(stderr, "Too many simulated faults\n");
+            return -1;
+        }
+
+        target = &gSimulator.Faults[gSimulator.NumFaults];
+
+        step = strchr(fault, '@');
+        if (step == NULL) {
+            fprintf(stderr, "Invalid simulated fault %s\n", fault);
+            return -1;
+        }
+
+        *step++ = '\0';
+
+        count = strchr(step, '*');
+        if (count != NULL) {
+            *count++ = '\0';
+        }
+
+        for (errorindex = 0; errorindex < sizeof(gSimulatedErrors) / sizeof(gSimulatedErrors[0]); errorindex++) {
+            if (strcmp(gSimulatedErrors[errorindex].Name, fault) == 0) {
+                break;
+            }
+        }
+
+        if (errorindex == sizeof(gSimulatedErrors) / sizeof(gSimulatedErrors[0])) {
+            fprintf(stderr, "Unknown simulated error %s\n", fault);
+            return -1;
+        }
+
+        target->Error = gSimulatedErrors[errorindex].Error;
+        target->Step = strtoul(step, NULL, 10);
+        target->Count = count != NULL ? strtoul(count, NULL, 10) : 1;
+        gSimulator.NumFaults++;
+    }
+
+    return 0;
+}
+
+void set_simulated_adc(uint8_t address, uint8_t lowbits, uint16_t value)
+{
+    gSimulator.Registers[address] = value >> lowbits;
+    gSimulator.Registers[address + 1] = value & ((1 << lowbits) - 1);
+}
+
+int step_simulator(void)
+{
+    uint32_t step = gSimulator.Step++;
+    uint16_t wave = step % 64 < 32 ? step % 64 : 64 - step % 64;
+    bool vbus = (step / SIMULATED_POWER_PERIOD) % 2 == 0;
+    uint8_t faultindex;
+
+    // Plug or unplug VBUS at the start of every power period.
+
+    if (step % SIMULATED_POWER_PERIOD == 0) {
+        gSimulator.Registers[0x00] = vbus ? 0x20 : 0x00;
+        gSimulator.Registers[0x01] = vbus ? 0x60 : 0x20;
+        gSimulator.Registers[0x48] |= vbus ? 0x08 : 0x04;
+    }
+
+    // ADC readings in their native units: 0.1 C, 1.1 mV, 0.5 mA, 1.7 mV and
+    // 0.375 mA respectively.
+
+    set_simulated_adc(0x5E, 4, 1847 + wave);
+    set_simulated_adc(0x78, 4, 3545 + wave * 4);
+    set_simulated_adc(0x7A, 4, vbus ? 800 + wave * 8 : 0);
+    set_simulated_adc(0x7C, 5, vbus ? 0 : 400 + wave * 4);
+    set_simulated_adc(0x5A, 4, vbus ? 2941 + wave : 0);
+    set_simulated_adc(0x5C, 4, vbus ? 1333 + wave * 8 : 0);
+    gSimulator.Registers[0xB9] = 80 + wave / 8;
+
+    for (faultindex = 0; faultindex < gSimulator.NumFaults; faultindex++) {
+        if (step - gSimulator.Faults[faultindex].Step < gSimulator.Faults[faultindex].Count) {
+            errno = gSimulator.Faults[faultindex].Error;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void simulate_read(uint8_t * buffer, size_t length)
+{
+    size_t index;
+
+    for (index = 0; index < length; index++) {
+        buffer[index] = gSimulator.Registers[gSimulator.Address++];
+    }
+}
+
+void simulate_write(const uint8_t * buffer, size_t length)
+{
+    size_t index;
+
+    if (length == 0) {
+        return;
+    }
+
+    gSimulator.Address = buffer[0];
+
+    for (index = 1; index < length; index++) {
+        if (gSimulator.Address >= 0x48 && gSimulator.Address <= 0x4C) {
+            gSimulator.Registers[gSimulator.Address++] &= ~buffer[index];
+        } else {
+            gSimulator.Registers[gSimulator.Address++] = buffer[index];
+        }
+    }
+}
+
+int simulator_open(void)
+{
+    // The chip keeps its registers, and the script its place, when the bus
+    // is reopened.
+
+    if (gSimulator.Step == 0) {
+        memset(gSimulator.Registers, 0, sizeof(gSimulator.Registers));
+        gSimulator.Registers[0x30] = 0x60;
+        gSimulator.Registers[0x33] = 0xC8;
+    }
+
+    gSimulator.Address = 0;
+
+    return 0;
+}
+
+void simulator_close(void)
+{
+}
+
+ssize_t simulator_read(uint8_t * buffer, size_t length)
+{
+    if (step_simulator() < 0) {
+        return -1;
+    }
+
+    simulate_read(buffer, length);
+    return length;
+}
+
+ssize_t simulator_write(const uint8_t * buffer, size_t length)
+{
+    if (step_simulator() < 0) {
+        return -1;
+    }
+
+    simulate_write(buffer, length);
+    return length;
+}
+
+int simulator_transfer(struct i2c_msg * messages, uint32_t count)
+{
+    uint32_t index;
+
+    if (step_simulator() < 0) {
+        return -1;
+    }
+
+    for (index = 0; index < count; index++) {
+        if (messages[index].flags & I2C_M_RD) {
+            simulate_read(messages[index].buf, messages[index].len);
+        } else {
+            simulate_write(messages[index].buf, messages[index].len);
+        }
+    }
+
+    return count;
+}
+
+const struct bus_backend gSimulatedBackend = { "simulated AXP209", simulator_open, simulator_close, simulator_read, simulator_write, simulator_transfer };
+
+const struct bus_backend * gBus = &gI2cBackend;
+
+int read_register_value(uint8_t address)
+{
+    int err;
+    uint8_t buffer[1] = { address };
+    uint64_t started = clock_ns(CLOCK_MONOTONIC);
+
+    gSyscalls += 2;
+    gTransfers += 2;
+    gBytes += 2;
+
+    // While the bus is down, the failures of each attempt to reopen it are
+    // not worth reporting again.
+
+    err = gBus->Write(buffer, sizeof(buffer));
+    if (err < 0) {
+        if (!gBusDown) {
+            fprintf(stderr, "Unable to query for register %#02x: %s\n", address, strerror(errno));
+        }
+
+        gBusErrors++;
+        return -1;
+    }
+
+    err = gBus->Read(buffer, sizeof(buffer));
+    if (err < 0) {
+        if (!gBusDown) {
+            fprintf(stderr, "Unable to read register %#02x: %s\n", address, strerror(errno));
+        }
+
+        gBusErrors++;
+        return -1;
+    }
+
+    record_latency(started);
+
+    return buffer[0];
+}
+
+int write_register_value(uint8_t address, uint8_t value)
+{
+    int err;
+    uint8_t buffer[2] = { address, value };
+    uint64_t started = clock_ns(CLOCK_MONOTONIC);
+
+    gSyscalls++;
+    gTransfers++;
+    gBytes += 2;
+
+    err = gBus->Write(buffer, sizeof(buffer));
+    if (err < 0) {
+        if (!gBusDown) {
+            fprintf(stderr, "Unable to write register %#02x: %s\n", address, strerror(errno));
+        }
+
+        gBusErrors++;
+        return -1;
+    }
+
+    record_latency(started);
+    return 0;
+}
+
+int enable_adc(void)
+{
+    int value;
+    bool wait;
+
+    // Ensure both ADC enable registers have sufficient bitmasks to enable the
+    // features necessary for querying power.
+
+    wait = false;
+
+    value = read_register_value(0x82);
+    if (value < 0) {
+        return -1;
+    }
+
+    if ((value & 0xCC) != 0xCC) {
+        if (write_register_value(0x82, value | 0xCC) < 0) {
+            return -1;
+        }
+
+        wait = true;
+    }
+
+    value = read_register_value(0x83);
+    if (value < 0) {
+        return -1;
+    }
+
+    if ((value & 0x80) != 0x80) {
+        if (write_register_value(0x83, value | 0x80) < 0) {
+            return -1;
+        }
+
+        wait = true;
+    }
+
+    // Wait for 1/25 seconds to ensure the ADC takes a reading.
+
+    if (wait) {
+        usleep(40000);
+    }
+
+    return 0;
+}
+
+void mark_register_field(const struct register_field * field, bool needed[256])
+{
+    needed[field->Register] = true;
+
+    if (field->LowBits) {
+        needed[(uint8_t)(field->Register + 1)] = true;
+    }
+
+    if (field->ValidMask) {
+        needed[field->ValidRegister] = true;
+    }
+}
+
+void build_read_plan(struct read_plan * plan, uint64_t dimensions, const uint8_t * registers, uint8_t numregisters)
+{
+    bool needed[256] = { false };
+    uint8_t dimindex;
+    uint8_t rangeindex;
+    uint16_t address;
+    uint16_t lastneeded;
+
+    // Select the register map rows to decode and the registers they need.
+
+    plan->Dimensions = dimensions;
+    plan->NumRows = 0;
+
+    for (dimindex = 0; dimindex < NUM_SENSOR_DIMENSIONS; dimindex++) {
+        if (dimensions & DIMENSION_BIT(gRegisterMap[dimindex].Dimension)) {
+            plan->Rows[plan->NumRows++] = gRegisterMap[dimindex];
+            mark_register_field(&gRegisterMap[dimindex], needed);
+        }
+    }
+
+    // Add the raw registers the caller reads for itself.
+
+    for (dimindex = 0; dimindex < numregisters; dimindex++) {
+        needed[registers[dimindex]] = true;
+    }
+
+    // Coalesce the needed registers into as few burst ranges as possible. The
+    // last range absorbs any registers beyond what fits in a single request.
+
+    plan->NumRanges = 0;
+    lastneeded = 0;
+
+    for (address = 0; address < 256; address++) {
+        if (!needed[address]) {
+            continue;
+        }
+
+        if (plan->NumRanges == 0 ||
+            (address - lastneeded > MAX_RANGE_GAP + 1 && plan->NumRanges < MAX_PLAN_RANGES)) {
+            plan->Ranges[plan->NumRanges].Start = address;
+            plan->NumRanges++;
+        }
+
+        plan->Ranges[plan->NumRanges - 1].Length = address - plan->Ranges[plan->NumRanges - 1].Start + 1;
+        lastneeded = address;
+    }
+
+    // Prebuild the I2C_RDWR message pairs for the planned ranges.
+
+    plan->NumBytes = 0;
+
+    for (rangeindex = 0; rangeindex < plan->NumRanges; rangeindex++) {
+        plan->Messages[rangeindex * 2].addr = AXP209_ADDRESS;
+        plan->Messages[rangeindex * 2].flags = 0;
+        plan->Messages[rangeindex * 2].len = 1;
+        plan->Messages[rangeindex * 2].buf = &plan->Ranges[rangeindex].Start;
+
+        plan->Messages[rangeindex * 2 + 1].addr = AXP209_ADDRESS;
+        plan->Messages[rangeindex * 2 + 1].flags = I2C_M_RD;
+        plan->Messages[rangeindex * 2 + 1].len = plan->Ranges[rangeindex].Length;
+        plan->Messages[rangeindex * 2 + 1].buf = &gShadow[plan->Ranges[rangeindex].Start];
+
+        plan->NumBytes += 1 + plan->Ranges[rangeindex].Length;
+    }
+}
+
+bool is_aggregate_dimension(enum Dimensions index)
+{
+    return index >= NUM_SENSOR_DIMENSIONS && index < NUM_SENSOR_DIMENSIONS + 2 * NUM_OVERSAMPLED_DIMENSIONS;
+}
+
+void plan_reads(void)
+{
+    uint8_t chartindex;
+    uint8_t dimindex;
+    enum Dimensions targetindex;
+    uint64_t sampled;
+    uint64_t config;
+    bool watchirq;
+
+    // Collect the dimensions of the enabled charts, along with the dimensions
+    // they are based on. Min/max dimensions only exist when oversampling.
+
+    gEnabledDimensions = 0;
+
+    for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
+        if (!gChartEnabled[chartindex]) {
+            continue;
+        }
+
+        for (dimindex = 0; dimindex < MAX_CHART_DIMENSIONS; dimindex++) {
+            targetindex = gChartDefinitions[chartindex].Dimensions[dimindex];
+            if (targetindex == EMPTY_DIM) {
+                break;
+            }
+
+            if (is_aggregate_dimension(targetindex) && gOversampleRate == 0) {
+                continue;
+            }
+
+            gEnabledDimensions |= DIMENSION_BIT(targetindex);
+
+            if (targetindex < NUM_SENSOR_DIMENSIONS && gRegisterMap[targetindex].Base != EMPTY_DIM) {
+                gEnabledDimensions |= DIMENSION_BIT(gRegisterMap[targetindex].Base);
+            }
+        }
+    }
+
+    // Config dimensions are only worth caching when they outlive a tick.
+
+    config = 0;
+
+    for (dimindex = 0; dimindex < NUM_SENSOR_DIMENSIONS; dimindex++) {
+        if (gRegisterMap[dimindex].Period == Config && is_dimension_enabled(gRegisterMap[dimindex].Dimension)) {
+            config |= DIMENSION_BIT(gRegisterMap[dimindex].Dimension);
+        }
+    }
+
+    gConfigTicks = (gConfigEvery + gUpdateEvery - 1) / gUpdateEvery;
+    gConfigTicks = gConfigTicks > 1 && config != 0 && gBackend != BackendSysfs ? gConfigTicks : 1;
+    gConfigCountdown = 0;
+    gCachedDimensions = gConfigTicks > 1 ? config : 0;
+
+    watchirq = gCachedDimensions != 0 || gEventPollRate > 0 || is_dimension_enabled(acinplugged);
+
+    if (watchirq) {
+        build_read_plan(&gFullPlan, gEnabledDimensions, gIrqStatusRegisters, sizeof(gIrqStatusRegisters));
+        build_read_plan(&gTickPlan, gEnabledDimensions & ~gCachedDimensions, gIrqStatusRegisters, sizeof(gIrqStatusRegisters));
+    } else {
+        build_read_plan(&gFullPlan, gEnabledDimensions, NULL, 0);
+        build_read_plan(&gTickPlan, gEnabledDimensions, NULL, 0);
+    }
+
+    build_read_plan(&gConfigPlan, gCachedDimensions, NULL, 0);
+    build_read_plan(&gEventPlan, 0, gIrqStatusRegisters, sizeof(gIrqStatusRegisters));
+
+    sampled = 0;
+
+    for (dimindex = 0; dimindex < NUM_OVERSAMPLED_DIMENSIONS; dimindex++) {
+        if (is_dimension_enabled(gAggregates[dimindex].Source)) {
+            sampled |= DIMENSION_BIT(gAggregates[dimindex].Source);
+        }
+    }
+
+    build_read_plan(&gSamplePlan, sampled, NULL, 0);
+}
+
+void reopen_bus(void)
+{
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    if (!gBusDown) {
+        fprintf(stderr, "Reopening the %s bus after %u failed reads\n", gBus->Name, gBusFailures);
+        gReopenInterval = MIN_REOPEN_INTERVAL;
+    } else if (now < gNextReopen) {
+        return;
+    }
+
+    gBusReopens++;
+    gBus->Close();
+
+    if (gBus->Open() < 0 || enable_adc() < 0) {
+        if (!gBusDown) {
+            fprintf(stderr, "Unable to reopen the %s bus: %s, retrying in the background\n", gBus->Name, strerror(errno));
+            gBusDown = true;
+        }
+
+        gNextReopen = now + gReopenInterval * NSEC_PER_SEC;
+        gReopenInterval = gReopenInterval < MAX_REOPEN_INTERVAL / 2 ? gReopenInterval * 2 : MAX_REOPEN_INTERVAL;
+        return;
+    }
+
+    if (gBusDown) {
+        fprintf(stderr, "Reopened the %s bus\n", gBus->Name);
+        gBusDown = false;
+    }
+
+    gBusFailures = 0;
+}
+
+int read_registers(const struct read_plan * plan)
+{
+    int err;
+    int attempt;
+    uint64_t started;
+
+    if (plan->NumRanges == 0) {
+        return 0;
+    }
+
+    // While the bus is down, reads only get as far as trying to reopen it
+    // when that is due.
+
+    if (gBusDown) {
+        reopen_bus();
+
+        if (gBusDown) {
+            return -1;
+        }
+    }
+
+    for (attempt = 0; attempt < MAX_BUS_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            usleep(BUS_BACKOFF_US << (attempt - 1));
+            gBusRetries++;
+        }
+
+        gSyscalls++;
+        gTransfers += plan->NumRanges;
+        gBytes += plan->NumBytes;
+
+        started = clock_ns(CLOCK_MONOTONIC);
+        err = gBus->Transfer((struct i2c_msg *)plan->Messages, plan->NumRanges * 2);
+        record_latency(started);
+
+        if (err >= 0) {
+            gBusFailures = 0;
+            return 0;
+        }
+
+        gBusErrors++;
+    }
+
+    if (gBusFailures++ == 0) {
+        fprintf(stderr, "Unable to read registers: %s\n", strerror(errno));
+    }
+
+    if (gBusFailures >= REOPEN_AFTER_FAILURES) {
+        reopen_bus();
+    }
+
+    return -1;
+}
+
+void decode_registers(const struct read_plan * plan)
+{
+    const struct register_field * row;
+    uint8_t rowindex;
+    uint16_t field;
+    int32_t value;
+    bool valid;
+
+    // Decode every planned row of the register map from the shadow. The
+    // address arithmetic wraps within the shadow for single-register fields,
+    // whose LowBits mask is empty.
+
+    for (rowindex = 0; rowindex < plan->NumRows; rowindex++) {
+        row = &plan->Rows[rowindex];
+
+        field = ((gShadow[row->Register] << row->LowBits) |
+                 (gShadow[(uint8_t)(row->Register + 1)] & ((1 << row->LowBits) - 1)));
+        field = (field >> row->Shift) & row->Mask;
+
+        value = field * row->Multiplier + row->Offset;
+        valid = (gShadow[row->ValidRegister] & row->ValidMask) != row->ValidReject;
+
+        if (row->Base != EMPTY_DIM) {
+            value *= gData[row->Base];
+            valid = valid && is_dimension_valid(row->Base);
+        }
+
+        gData[row->Dimension] = value;
+        gIsValid = (gIsValid & ~DIMENSION_BIT(row->Dimension)) | (valid ? DIMENSION_BIT(row->Dimension) : 0);
+    }
+}
+
+void accumulate_samples(void)
+{
+    uint8_t index;
+    int32_t value;
+
+    for (index = 0; index < NUM_OVERSAMPLED_DIMENSIONS; index++) {
+        if (!is_dimension_enabled(gAggregates[index].Source) || !is_dimension_valid(gAggregates[index].Source)) {
+            continue;
+        }
+
+        value = gData[gAggregates[index].Source];
+
+        if (gAggregates[index].Count == 0 || value < gAggregates[index].Minimum) {
+            gAggregates[index].Minimum = value;
+        }
+
+        if (gAggregates[index].Count == 0 || value > gAggregates[index].Maximum) {
+            gAggregates[index].Maximum = value;
+        }
+
+        gAggregates[index].Sum += value;
+        gAggregates[index].Count++;
+    }
+}
+
+void save_aggregates(void)
+{
+    uint8_t index;
+    int64_t count;
+
+    for (index = 0; index < NUM_OVERSAMPLED_DIMENSIONS; index++) {
+        count = gAggregates[index].Count;
+        if (count == 0) {
+            continue;
+        }
+
+        // The tick itself may have read an invalid value even though earlier
+        // samples were valid; the interval is still reported from those.
+
+        save_data(gAggregates[index].Source, (gAggregates[index].Sum + count / 2) / count);
+        save_data(gAggregates[index].Min, gAggregates[index].Minimum);
+        save_data(gAggregates[index].Max, gAggregates[index].Maximum);
+
+        gAggregates[index].Sum = 0;
+        gAggregates[index].Count = 0;
+    }
+}
+
+//
+// Power supply sysfs backend. On kernels with the axp20x drivers, the values
+// are available from the power supply class and the PMIC's IIO ADC, and the
+// plugin must not force its way onto the driver's I2C address. This backend
+// reads the same dimensions from those attributes instead, keeping every file
+// open and rereading it with pread() at offset 0 on each tick. Values are
+// converted to the scaled integers the register map produces, so the charts
+// are unchanged:
+//   value = raw * Multiplier / Divisor + Offset
+// Negative raw * Multiplier products are kept, clamped at 0 (to split the
+// signed battery current into charge and discharge), or rejected (the VBUS
+// current limit is -1 when there is none). A dimension is valid while its
+// supply reports being present. chargeterm has no sysfs equivalent and stays
+// empty. Attribute names may be fnmatch() patterns, as the IIO channel
+// numbers differ between PMICs.
+//
+
+#define POWER_SUPPLY_DIRECTORY "/sys/class/power_supply/"
+#define IIO_DEVICE_DIRECTORY "/sys/bus/iio/devices/"
+#define IIO_ADC_NAME "axp20x-adc"
+
+enum SysfsDevice
+{
+    SysfsBattery,
+    SysfsAc,
+    SysfsUsb,
+    SysfsAdc,
+    NUM_SYSFS_DEVICES
+};
+
+enum NegativeValues
+{
+    KeepNegative,
+    ClampNegative,
+    RejectNegative
+};
+
+#define SYSFS_ATTRIBUTES(X) \
+    /* Dimension        Device        Attribute                  Mul  Div   Off     Negative */ \
+    X(internaltemp,     SysfsAdc,     "in_temp*_raw",            18,  1,    -22846, KeepNegative)   \
+    X(batlevel,         SysfsBattery, "capacity",                1,   1,    0,      KeepNegative)   \
+    X(chargelimit,      SysfsBattery, "constant_charge_current", 1,   1000, 0,      KeepNegative)   \
+    X(batcharge,        SysfsBattery, "current_now",             1,   500,  0,      ClampNegative)  \
+    X(batdischarge,     SysfsBattery, "current_now",             -1,  500,  0,      ClampNegative)  \
+    X(batvoltage,       SysfsBattery, "voltage_now",             1,   100,  0,      KeepNegative)   \
+    X(acinvoltage,      SysfsAc,      "voltage_now",             1,   100,  0,      KeepNegative)   \
+    X(acincurrent,      SysfsAc,      "current_now",             1,   125,  0,      KeepNegative)   \
+    X(vbusvoltage,      SysfsUsb,     "voltage_now",             1,   100,  0,      KeepNegative)   \
+    X(vbusvoltagelimit, SysfsUsb,     "voltage_min",             1,   1000, 0,      KeepNegative)   \
+    X(vbuscurrent,      SysfsUsb,     "current_now",             1,   125,  0,      KeepNegative)   \
+    X(vbuscurrentlimit, SysfsUsb,     "current_max",             1,   1000, 0,      RejectNegative)
+
+#define SYSFS_ATTRIBUTE(dimension, device, attribute, mul, div, off, negative) \
+    { dimension, device, attribute, mul, div, off, negative, -1 },
+
+struct
+{
+    const enum Dimensions Dimension;
+    const enum SysfsDevice Device;
+    const char * const Attribute;
+    const int32_t Multiplier;
+    const int32_t Divisor;
+    const int32_t Offset;
+    const enum NegativeValues Negative;
+    int Fd;
+} gSysfsAttributes[] = {
+    SYSFS_ATTRIBUTES(SYSFS_ATTRIBUTE)
+};
+
+#define NUM_SYSFS_ATTRIBUTES (sizeof(gSysfsAttributes) / sizeof(gSysfsAttributes[0]))
+
+struct
+{
+    const char * const Name;
+    const enum Dimensions PluggedEvent;
+    const enum Dimensions RemovedEvent;
+    char Path[PATH_MAX];
+    int PresentFd;
+    bool Present;
+} gSysfsDevices[NUM_SYSFS_DEVICES] = {
+    { "axp20x-battery", batplugged,  batremoved,  "", -1, false },
+    { "axp20x-ac",      acinplugged, acinremoved, "", -1, false },
+    { "axp20x-usb",     vbusplugged, vbusremoved, "", -1, false },
+    { IIO_ADC_NAME,     EMPTY_DIM,   EMPTY_DIM,   "", -1, false },
+};
+
+bool gSysfsRead;
+
+bool is_sysfs_available(void)
+{
+    return access(POWER_SUPPLY_DIRECTORY "axp20x-battery", F_OK) == 0 ||
+           access(POWER_SUPPLY_DIRECTORY "axp20x-usb", F_OK) == 0;
+}
+
+int read_sysfs_value(int fd, long * value)
+{
+    char buffer[32];
+    ssize_t length;
+    char * end;
+
+    length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return -1;
+    }
+
+    buffer[length] = '\0';
+    *value = strtol(buffer, &end, 10);
+
+    return end != buffer ? 0 : -1;
+}
+
+void find_iio_adc(char * path, size_t size)
+{
+    char name[64];
+    int index;
+    int fd;
+    long length;
+
+    // The IIO device number depends on probe order, so look for the ADC by
+    // name.
+
+    for (index = 0; index < 16; index++) {
+        snprintf(path, size, IIO_DEVICE_DIRECTORY "iio:device%d/name", index);
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        length = read(fd, name, sizeof(name) - 1);
+        close(fd);
+
+        name[length > 0 ? length : 0] = '\0';
+
+        if (strcmp(name, IIO_ADC_NAME "\n") == 0) {
+            snprintf(path, size, IIO_DEVICE_DIRECTORY "iio:device%d/", index);
+            return;
+        }
+    }
+
+    path[0] = '\0';
+}
+
+int open_sysfs_attribute(const char * directory, const char * attribute)
+{
+    char path[PATH_MAX + NAME_MAX + 1];
+    struct dirent * entry;
+    DIR * listing;
+    int fd = -1;
+
+    if (strchr(attribute, '*') == NULL) {
+        snprintf(path, sizeof(path), "%s%s", directory, attribute);
+        return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    listing = opendir(directory);
+    if (listing == NULL) {
+        return -1;
+    }
+
+    while (fd < 0 && (entry = readdir(listing)) != NULL) {
+        if (fnmatch(attribute, entry->d_name, 0) == 0) {
+            snprintf(path, sizeof(path), "%s%s", directory, entry->d_name);
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+
+    closedir(listing);
+    return fd;
+}
+
+int open_sysfs_attributes(void)
+{
+    char path[PATH_MAX + 32];
+    uint8_t index;
+    uint8_t device;
+
+    for (device = 0; device < NUM_SYSFS_DEVICES; device++) {
+        if (device == SysfsAdc) {
+            find_iio_adc(gSysfsDevices[device].Path, sizeof(gSysfsDevices[device].Path));
+            gSysfsDevices[device].Present = gSysfsDevices[device].Path[0] != '\0';
+            continue;
+        }
+
+        snprintf(gSysfsDevices[device].Path, sizeof(gSysfsDevices[device].Path), POWER_SUPPLY_DIRECTORY "%s/", gSysfsDevices[device].Name);
+        snprintf(path, sizeof(path), "%spresent", gSysfsDevices[device].Path);
+        gSysfsDevices[device].PresentFd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (gSysfsDevices[SysfsBattery].PresentFd < 0 && gSysfsDevices[SysfsUsb].PresentFd < 0) {
+        return -1;
+    }
+
+    for (index = 0; index < NUM_SYSFS_ATTRIBUTES; index++) {
+        if (!is_dimension_enabled(gSysfsAttributes[index].Dimension) || gSysfsDevices[gSysfsAttributes[index].Device].Path[0] == '\0') {
+            continue;
+        }
+
+        gSysfsAttributes[index].Fd = open_sysfs_attribute(gSysfsDevices[gSysfsAttributes[index].Device].Path, gSysfsAttributes[index].Attribute);
+        if (gSysfsAttributes[index].Fd < 0) {
+            fprintf(stderr, "Unable to open %s%s, %s will be empty\n", gSysfsDevices[gSysfsAttributes[index].Device].Path,
+                    gSysfsAttributes[index].Attribute, gDimensionDefinitions[gSysfsAttributes[index].Dimension].Name);
+        }
+    }
+
+    return 0;
+}
+
+void read_sysfs_attributes(uint64_t dimensions)
+{
+    uint8_t index;
+    uint8_t device;
+    long raw;
+    int64_t value;
+    bool present;
+
+    for (device = 0; device < NUM_SYSFS_DEVICES; device++) {
+        present = gSysfsDevices[device].PresentFd < 0 ?
+            gSysfsDevices[device].Path[0] != '\0' :
+            read_sysfs_value(gSysfsDevices[device].PresentFd, &raw) == 0 && raw != 0;
+
+        if (gSysfsRead && present != gSysfsDevices[device].Present) {
+            count_power_event(present ? gSysfsDevices[device].PluggedEvent : gSysfsDevices[device].RemovedEvent);
+        }
+
+        gSysfsDevices[device].Present = present;
+    }
+
+    gSysfsRead = true;
+
+    for (index = 0; index < NUM_SYSFS_ATTRIBUTES; index++) {
+        if (gSysfsAttributes[index].Fd < 0 || !(dimensions & DIMENSION_BIT(gSysfsAttributes[index].Dimension))) {
+            continue;
+        }
+
+        gIsValid &= ~DIMENSION_BIT(gSysfsAttributes[index].Dimension);
+
+        if (!gSysfsDevices[gSysfsAttributes[index].Device].Present ||
+            read_sysfs_value(gSysfsAttributes[index].Fd, &raw) < 0) {
+            continue;
+        }
+
+        value = (int64_t)raw * gSysfsAttributes[index].Multiplier;
+
+        if (value < 0 && gSysfsAttributes[index].Negative == ClampNegative) {
+            value = 0;
+        } else if (value < 0 && gSysfsAttributes[index].Negative == RejectNegative) {
+            continue;
+        }
+
+        value = value / gSysfsAttributes[index].Divisor + gSysfsAttributes[index].Offset;
+
+        save_data(gSysfsAttributes[index].Dimension, value);
+    }
+}
+
+//
+// Recording. With the record option, the register ranges read on each tick
+// are appended to a file so that real collections can be replayed offline.
+// The file starts with RECORD_MAGIC and holds one record per tick, in host
+// byte order:
+//   uint64_t  CLOCK_MONOTONIC timestamp of the tick in ns
+//   uint16_t  payload length in bytes, or'ed with RECORD_FAILED when one of
+//             the tick's reads failed
+//   payload   one (uint8_t start, uint8_t length, register bytes) entry per
+//             range read, in the order they were read
+// A record is assembled in gRecorder while the tick reads its plans, and
+// written at once when the tick completes. A failed tick is replayed without
+// any valid dimension, rather than from registers left over from earlier
+// records.
+//
+
+#define RECORD_MAGIC "CHIPREC1"
+#define RECORD_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint16_t))
+#define RECORD_BUFFER_SIZE (RECORD_HEADER_SIZE + 2 * (256 + 2 * MAX_PLAN_RANGES))
+#define RECORD_FAILED 0x8000
+
+struct
+{
+    int Fd;
+    bool Failed;
+    size_t Length;
+    uint8_t Buffer[RECORD_BUFFER_SIZE];
+} gRecorder = { -1, false, RECORD_HEADER_SIZE, { 0 } };
+
+char gRecordPath[PATH_MAX];
+char gReplayPath[PATH_MAX];
+
+int start_recording(void)
+{
+    struct stat status;
+
+    gRecorder.Fd = open(gRecordPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (gRecorder.Fd < 0 || fstat(gRecorder.Fd, &status) < 0) {
+        return -1;
+    }
+
+    if (status.st_size == 0 && write(gRecorder.Fd, RECORD_MAGIC, strlen(RECORD_MAGIC)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void record_plan(const struct read_plan * plan)
+{
+    uint8_t rangeindex;
+
+    if (gRecorder.Fd < 0) {
+        return;
+    }
+
+    for (rangeindex = 0; rangeindex < plan->NumRanges; rangeindex++) {
+        gRecorder.Buffer[gRecorder.Length++] = plan->Ranges[rangeindex].Start;
+        gRecorder.Buffer[gRecorder.Length++] = plan->Ranges[rangeindex].Length;
+        memcpy(&gRecorder.Buffer[gRecorder.Length], &gShadow[plan->Ranges[rangeindex].Start], plan->Ranges[rangeindex].Length);
+        gRecorder.Length += plan->Ranges[rangeindex].Length;
+    }
+}
+
+void record_failure(void)
+{
+    gRecorder.Failed = true;
+}
+
+void finish_record(uint64_t timestamp)
+{
+    uint16_t length = (gRecorder.Length - RECORD_HEADER_SIZE) | (gRecorder.Failed ? RECORD_FAILED : 0);
+
+    gRecorder.Failed = false;
+
+    if (gRecorder.Fd < 0) {
+        return;
+    }
+
+    memcpy(gRecorder.Buffer, &timestamp, sizeof(timestamp));
+    memcpy(gRecorder.Buffer + sizeof(timestamp), &length, sizeof(length));
+
+    if (write(gRecorder.Fd, gRecorder.Buffer, gRecorder.Length) != (ssize_t)gRecorder.Length) {
+        fprintf(stderr, "Unable to write to %s, recording stopped\n", gRecordPath);
+        close(gRecorder.Fd);
+        gRecorder.Fd = -1;
+    }
+
+    gRecorder.Length = RECORD_HEADER_SIZE;
+}
+
+bool check_power_events(bool * reconfigured)
+{
+    uint8_t index;
+    uint8_t latched;
+    uint8_t clear[sizeof(gIrqStatusRegisters)] = { 0 };
+    bool event = false;
+
+    *reconfigured = false;
+
+    // Bits already set on the first read happened before the plugin started.
+
+    for (index = 0; index < NUM_POWER_EVENTS; index++) {
+        latched = gShadow[gPowerEvents[index].Register] & ~gLastIrqStatus[gPowerEvents[index].Register - IRQ_STATUS_1];
+
+        if (latched & gPowerEvents[index].Mask && gIrqStatusRead) {
+            gPowerEvents[index].Count++;
+            *reconfigured |= gPowerEvents[index].Reconfiguring;
+            event = true;
+        }
+
+        if (gClearIrqStatus) {
+            clear[gPowerEvents[index].Register - IRQ_STATUS_1] |= gShadow[gPowerEvents[index].Register] & gPowerEvents[index].Mask;
+        }
+    }
+
+    // A bit that fails to clear stays set, and is only counted again once it
+    // has been cleared and latched anew.
+
+    for (index = 0; index < sizeof(gIrqStatusRegisters); index++) {
+        gLastIrqStatus[index] = gShadow[gIrqStatusRegisters[index]];
+
+        if (clear[index] && write_register_value(gIrqStatusRegisters[index], clear[index]) == 0) {
+            gLastIrqStatus[index] &= ~clear[index];
+        }
+    }
+
+    gIrqStatusRead = true;
+    return event;
+}
+
+void gather_chart_data(bool scheduled)
+{
+    bool reconfigured;
+    uint8_t index;
+
+    // Only the cached dimensions carry over from the previous tick.
+
+    gIsValid &= gCachedDimensions;
+
+    // When a read fails, its dimensions stay invalid for this tick. A failed
+    // full or config read is tried again on the next tick.
+
+    if (gBackend == BackendSysfs) {
+        read_sysfs_attributes(gEnabledDimensions);
+    } else if (gConfigCountdown == 0) {
+        if (read_registers(&gFullPlan) == 0) {
+            record_plan(&gFullPlan);
+            decode_registers(&gFullPlan);
+            check_power_events(&reconfigured);
+
+            gConfigCountdown = gConfigTicks - 1;
+        } else {
+            record_failure();
+            gIsValid = 0;
+        }
+    } else {
+        if (scheduled) {
+            gConfigCountdown--;
+        }
+
+        if (read_registers(&gTickPlan) == 0) {
+            record_plan(&gTickPlan);
+            decode_registers(&gTickPlan);
+
+            if (check_power_events(&reconfigured) && reconfigured && gCachedDimensions) {
+                if (read_registers(&gConfigPlan) == 0) {
+                    record_plan(&gConfigPlan);
+                    decode_registers(&gConfigPlan);
+                } else {
+                    record_failure();
+                    gIsValid &= ~gCachedDimensions;
+                    gConfigCountdown = 0;
+                }
+            }
+        } else {
+            record_failure();
+        }
+    }
+
+    if (gOversampleRate > 0) {
+        accumulate_samples();
+        save_aggregates();
+    }
+
+    save_data(i2csyscalls, gSyscalls);
+    save_data(i2ctransfers, gTransfers);
+    save_data(i2cbytes, gBytes);
+    save_data(i2cerrors, gBusErrors);
+    save_data(i2cretries, gBusRetries);
+    save_data(i2creopens, gBusReopens);
+
+    for (index = 0; index < NUM_POWER_EVENTS; index++) {
+        save_data(gPowerEvents[index].Dimension, gPowerEvents[index].Count);
+    }
+
+    if (gIntervalLatency.Total > 0) {
+        save_data(i2clatencyp50, latency_percentile(&gIntervalLatency, 500));
+        save_data(i2clatencyp99, latency_percentile(&gIntervalLatency, 990));
+        save_data(i2clatencymax, gIntervalLatency.Maximum);
+
+        memset(&gIntervalLatency, 0, sizeof(gIntervalLatency));
+    }
+
+    gSyscalls = 0;
+    gTransfers = 0;
+    gBytes = 0;
+}
+
+void print_charts_preamble()
+{
+    // Documentation: https://github.com/firehol/netdata/wiki/External-Plugins#chart
+    // The format for each chart is:
+    //   CHART type.id name title units [family [context [charttype (line, area, stacked)]]]]
+    //   DIMENSION id [name [algorithm [multiplier [divisor [hidden]]]]]
+    //   (repeat dimensions as necessary)
+    // Values are emitted as scaled integers, so each dimension carries the
+    // divisor that turns them back into chart units.
+
+    uint8_t chartindex;
+    uint8_t dimindex;
+    enum Dimensions targetindex;
+
+    for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
+        if (!gChartEnabled[chartindex]) {
+            continue;
+        }
+
+        printf("CHART %s %s\n",
+               gChartDefinitions[chartindex].Name,
+               gChartDefinitions[chartindex].Properties);
+
+        for (dimindex = 0; dimindex < MAX_CHART_DIMENSIONS; dimindex++) {
+            targetindex = gChartDefinitions[chartindex].Dimensions[dimindex];
+            if (targetindex == EMPTY_DIM) {
+                break;
+            }
+
+            if (is_dimension_enabled(targetindex)) {
+                printf("DIMENSION %s %s 1 %" PRId32 "\n",
+                       gDimensionDefinitions[targetindex].Name,
+                       gDimensionDefinitions[targetindex].Properties,
+                       gDimensionDefinitions[targetindex].Divisor);
+            }
+        }
+    }
+
+    fflush(stdout);
+}
+
+//
+// Output stage. The constant fragments of a data frame, such as
+// "BEGIN Chip.temps" and "SET batvoltage = ", are rendered once at startup by
+// prepare_output(). Each tick, print_chart_data() assembles the whole frame in
+// gOutput from those fragments and hand-formatted integers, and hands it to
+// the pipe with a single write() without going through stdio.
+//
+// A frame is formatted from a sample, a copy of gData and gIsValid taken when
+// it was collected, so that it can be emitted later on another thread.
+//
+
+#define MAX_FRAGMENT_LENGTH 48
+#define MAX_UINT64_DIGITS 20
+#define MAX_INT32_DIGITS 11
+
+struct output_fragment
+{
+    char Text[MAX_FRAGMENT_LENGTH];
+    uint8_t Length;
+};
+
+struct
+{
+    struct output_fragment Begin;
+    uint8_t NumSets;
+    enum Dimensions Dimensions[MAX_CHART_DIMENSIONS];
+    struct output_fragment Sets[MAX_CHART_DIMENSIONS];
+} gFrameCharts[NUM_CHARTS];
+
+uint8_t gNumFrameCharts;
+
+struct sample
+{
+    uint64_t Delay;     // Microseconds since the previous sample, 0 if none
+    uint64_t IsValid;
+    int32_t Data[MaxDimensions];
+};
+
+void snapshot_sample(struct sample * sample, uint64_t delayus)
+{
+    sample->Delay = delayus;
+    sample->IsValid = gIsValid;
+    memcpy(sample->Data, gData, sizeof(sample->Data));
+}
+
+#define OUTPUT_BUFFER_SIZE \
+    (NUM_CHARTS * (MAX_FRAGMENT_LENGTH + 1 + MAX_UINT64_DIGITS + 1 + sizeof("END\n") + \
+                   MAX_CHART_DIMENSIONS * (MAX_FRAGMENT_LENGTH + MAX_INT32_DIGITS + 1)))
+
+char gOutput[OUTPUT_BUFFER_SIZE];
+
+const char gDigitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+char * format_uint64(char * cursor, uint64_t value)
+{
+    char digits[MAX_UINT64_DIGITS];
+    char * start = digits + sizeof(digits);
+
+    // Emit two digits at a time from the end, then copy them into place.
+
+    while (value >= 100) {
+        start -= 2;
+        memcpy(start, &gDigitPairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, &gDigitPairs[value * 2], 2);
+    } else {
+        *--start = '0' + value;
+    }
+
+    memcpy(cursor, start, digits + sizeof(digits) - start);
+    return cursor + (digits + sizeof(digits) - start);
+}
+
+char * format_data_value(const struct sample * sample, enum Dimensions index, char * cursor)
+{
+    int32_t value = sample->Data[index];
+
+    if ((sample->IsValid & DIMENSION_BIT(index)) == 0) {
+        return cursor;
+    }
+
+    if (value < 0) {
+        *cursor++ = '-';
+        return format_uint64(cursor, -(int64_t)value);
+    }
+
+    return format_uint64(cursor, value);
+}
+
+int set_fragment(struct output_fragment * fragment, const char * prefix, const char * name, const char * suffix)
+{
+    int length = snprintf(fragment->Text, sizeof(fragment->Text), "%s%s%s", prefix, name, suffix);
+
+    if (length < 0 || length >= (int)sizeof(fragment->Text)) {
+        fprintf(stderr, "Name %s is too long for the output buffer\n", name);
+        return -1;
+    }
+
+    fragment->Length = length;
+    return 0;
+}
+
+int prepare_output(void)
+{
+    // Documentation: https://github.com/firehol/netdata/wiki/External-Plugins#data-collection
+    // The format for each chart is:
+    //   BEGIN type.id [microseconds]
+    //   SET id = value
+    //   (repeat as necessary)
+    //   END
+
+    uint8_t chartindex;
+    uint8_t dimindex;
+    enum Dimensions targetindex;
+
+    gNumFrameCharts = 0;
+
+    for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
+        if (!gChartEnabled[chartindex]) {
+            continue;
+        }
+
+        if (set_fragment(&gFrameCharts[gNumFrameCharts].Begin, "BEGIN ", gChartDefinitions[chartindex].Name, "") < 0) {
+            return -1;
+        }
+
+        gFrameCharts[gNumFrameCharts].NumSets = 0;
+
+        for (dimindex = 0; dimindex < MAX_CHART_DIMENSIONS; dimindex++) {
+            targetindex = gChartDefinitions[chartindex].Dimensions[dimindex];
+            if (targetindex == EMPTY_DIM) {
+                break;
+            }
+
+            if (is_dimension_enabled(targetindex)) {
+                uint8_t setindex = gFrameCharts[gNumFrameCharts].NumSets++;
+
+                gFrameCharts[gNumFrameCharts].Dimensions[setindex] = targetindex;
+                if (set_fragment(&gFrameCharts[gNumFrameCharts].Sets[setindex], "SET ",
+                                 gDimensionDefinitions[targetindex].Name, " = ") < 0) {
+                    return -1;
+                }
+            }
+        }
+
+        gNumFrameCharts++;
+    }
+
+    return 0;
+}
+
+void write_output(const char * buffer, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(STDOUT_FILENO, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "Unable to write chart data\n");
+            exit(1);
+        }
+
+        buffer += written;
+        length -= written;
+    }
+}
+
+size_t format_chart_data(const struct sample * sample, char * buffer)
+{
+    char * cursor = buffer;
+    uint8_t chartindex;
+    uint8_t setindex;
+
+    for (chartindex = 0; chartindex < gNumFrameCharts; chartindex++) {
+
+        // Chart prologue
+
+        memcpy(cursor, gFrameCharts[chartindex].Begin.Text, gFrameCharts[chartindex].Begin.Length);
+        cursor += gFrameCharts[chartindex].Begin.Length;
+
+        if (sample->Delay) {
+            *cursor++ = ' ';
+            cursor = format_uint64(cursor, sample->Delay);
+        }
+
+        *cursor++ = '\n';
+
+        // Dimension data
+
+        for (setindex = 0; setindex < gFrameCharts[chartindex].NumSets; setindex++) {
+            memcpy(cursor, gFrameCharts[chartindex].Sets[setindex].Text, gFrameCharts[chartindex].Sets[setindex].Length);
+            cursor += gFrameCharts[chartindex].Sets[setindex].Length;
+
+            cursor = format_data_value(sample, gFrameCharts[chartindex].Dimensions[setindex], cursor);
+            *cursor++ = '\n';
+        }
+
+        // Chart epilogue
+
+        memcpy(cursor, "END\n", 4);
+        cursor += 4;
+    }
+
+    return cursor - buffer;
+}
+
+void print_chart_data(const struct sample * sample)
+{
+    write_output(gOutput, format_chart_data(sample, gOutput));
+}
+
+//
+// Emitter thread. Collection runs on the main thread, and hands every sample
+// to the emitter thread through a lock-free single-producer/single-consumer
+// ring, so a slow reader on the other end of stdout never delays or skews the
+// next sample. Each sample carries its own delay since the previous one, so
+// netdata still files it under its collection time when it is emitted late.
+// When the ring is full the newest sample is dropped and counted.
+//
+// Function results are passed the same way through a ring of their own, so
+// that the emitter thread is the only writer to stdout and frames are never
+// interleaved with other output.
+//
+// stdout is non-blocking, so that the emitter thread keeps draining the rings
+// while netdata is not reading. Samples wait in a bounded queue of pending
+// frames, and whenever the pipe has room, up to MAX_COALESCED_FRAMES of them
+// are formatted and written out together with a single writev(). When the
+// queue is full, the output policy either drops the oldest pending frame to
+// keep the newest ones, or keeps all the pending frames and drops the new one.
+// Either way, the delay of a dropped frame is added to the frame after it,
+// since netdata measures each frame from the last one it received.
+//
+// Any other error writing to stdout, such as EPIPE once netdata has gone, ends
+// the emitter thread, which signals its Failure eventfd so that the main
+// thread's event loop stops and the plugin shuts down as usual, flushing the
+// log and the store on the way out. SIGPIPE is ignored for this.
+//
+// The head is only advanced by the producer and the tail only by the
+// consumer. Both run freely and wrap around, and the slot index is taken
+// modulo the power of two number of slots. The release store of the head
+// publishes the slot contents to the consumer, and the release store of the
+// tail hands the slot back to the producer.
+//
+
+#define SAMPLE_RING_SLOTS 64
+#define MESSAGE_RING_SLOTS 4
+#define MAX_MESSAGE_LENGTH 2048
+#define CACHE_LINE_SIZE 64
+#define MAX_PENDING_FRAMES 64
+#define DEFAULT_PENDING_FRAMES 16
+#define MAX_COALESCED_FRAMES 8
+
+struct spsc_ring
+{
+    alignas(CACHE_LINE_SIZE) atomic_uint Head;
+    alignas(CACHE_LINE_SIZE) atomic_uint Tail;
+    alignas(CACHE_LINE_SIZE) unsigned NumSlots;
+    size_t SlotSize;
+    uint8_t * Slots;
+};
+
+struct message
+{
+    size_t Length;
+    char Text[MAX_MESSAGE_LENGTH];
+};
+
+struct sample gSampleSlots[SAMPLE_RING_SLOTS];
+struct message gMessageSlots[MESSAGE_RING_SLOTS];
+
+_Static_assert((SAMPLE_RING_SLOTS & (SAMPLE_RING_SLOTS - 1)) == 0, "Ring sizes must be powers of two");
+_Static_assert((MESSAGE_RING_SLOTS & (MESSAGE_RING_SLOTS - 1)) == 0, "Ring sizes must be powers of two");
+
+struct
+{
+    struct spsc_ring Samples;
+    struct spsc_ring Messages;
+    int Wakeup;
+    int Failure;
+    pthread_t Thread;
+    atomic_bool Stopping;
+    atomic_bool Failed;
+    atomic_uint_fast64_t EmitTime;
+    atomic_uint Dropped;
+    uint64_t CarriedDelay;
+} gEmitter = {
+    .Samples = { .NumSlots = SAMPLE_RING_SLOTS, .SlotSize = sizeof(struct sample), .Slots = (uint8_t *)gSampleSlots },
+    .Messages = { .NumSlots = MESSAGE_RING_SLOTS, .SlotSize = sizeof(struct message), .Slots = (uint8_t *)gMessageSlots },
+    .Wakeup = -1,
+    .Failure = -1,
+};
+
+// Producer side: returns the next free slot, or NULL if the ring is full.
+
+void * claim_ring_slot(struct spsc_ring * ring)
+{
+    unsigned head = atomic_load_explicit(&ring->Head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->Tail, memory_order_acquire);
+
+    if (head - tail == ring->NumSlots) {
+        return NULL;
+    }
+
+    return ring->Slots + (head & (ring->NumSlots - 1)) * ring->SlotSize;
+}
+
+void publish_ring_slot(struct spsc_ring * ring)
+{
+    unsigned head = atomic_load_explicit(&ring->Head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->Head, head + 1, memory_order_release);
+}
+
+// Consumer side: returns the oldest published slot, or NULL if the ring is
+// empty.
+
+void * peek_ring_slot(struct spsc_ring * ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->Tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->Head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return ring->Slots + (tail & (ring->NumSlots - 1)) * ring->SlotSize;
+}
+
+void release_ring_slot(struct spsc_ring * ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->Tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->Tail, tail + 1, memory_order_release);
+}
+
+void wake_emitter(void)
+{
+    uint64_t one = 1;
+
+    if (gEmitter.Wakeup >= 0 && write(gEmitter.Wakeup, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to wake the emitter thread\n");
+    }
+}
+
+// Gives up on the output and tells the main thread to shut down.
+
+void fail_emitter(void)
+{
+    uint64_t one = 1;
+
+    atomic_store(&gEmitter.Failed, true);
+
+    if (gEmitter.Failure >= 0 && write(gEmitter.Failure, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Unable to stop the event loop\n");
+    }
+}
+
+enum OutputPolicy
+{
+    KeepNewest,
+    KeepAll,
+};
+
+// Pending frames, owned by the emitter thread. The first BatchStart..BatchEnd
+// entries of Batch are what is left to write of the frames or the message
+// currently being written.
+
+struct
+{
+    enum OutputPolicy Policy;
+    unsigned Limit;
+    struct sample Frames[MAX_PENDING_FRAMES];
+    unsigned First;
+    unsigned Count;
+    uint64_t CarriedDelay;
+    char Buffers[MAX_COALESCED_FRAMES][OUTPUT_BUFFER_SIZE];
+    struct iovec Batch[MAX_COALESCED_FRAMES];
+    unsigned BatchStart;
+    unsigned BatchEnd;
+    bool BatchIsMessage;
+} gPending = {
+    .Policy = KeepNewest,
+    .Limit = DEFAULT_PENDING_FRAMES,
+};
+
+void queue_sample(uint64_t delayus)
+{
+    struct sample * sample = claim_ring_slot(&gEmitter.Samples);
+
+    if (sample == NULL) {
+        atomic_fetch_add_explicit(&gEmitter.Dropped, 1, memory_order_relaxed);
+        gEmitter.CarriedDelay += delayus;
+        return;
+    }
+
+    snapshot_sample(sample, delayus + gEmitter.CarriedDelay);
+    gEmitter.CarriedDelay = 0;
+
+    publish_ring_slot(&gEmitter.Samples);
+    wake_emitter();
+}
+
+int queue_message(const char * text, size_t length)
+{
+    struct message * message = claim_ring_slot(&gEmitter.Messages);
+
+    if (message == NULL || length > sizeof(message->Text)) {
+        return -1;
+    }
+
+    memcpy(message->Text, text, length);
+    message->Length = length;
+    publish_ring_slot(&gEmitter.Messages);
+    wake_emitter();
+
+    return 0;
+}
+
+void add_pending_frame(const struct sample * sample)
+{
+    struct sample * frame;
+
+    if (gPending.Count == gPending.Limit) {
+        atomic_fetch_add_explicit(&gEmitter.Dropped, 1, memory_order_relaxed);
+
+        if (gPending.Policy == KeepAll) {
+            gPending.CarriedDelay += sample->Delay;
+            return;
+        }
+
+        frame = &gPending.Frames[gPending.First];
+        gPending.First = (gPending.First + 1) % MAX_PENDING_FRAMES;
+        gPending.Count--;
+
+        if (gPending.Count > 0) {
+            gPending.Frames[gPending.First].Delay += frame->Delay;
+        } else {
+            gPending.CarriedDelay += frame->Delay;
+        }
+    }
+
+    frame = &gPending.Frames[(gPending.First + gPending.Count) % MAX_PENDING_FRAMES];
+    *frame = *sample;
+    frame->Delay += gPending.CarriedDelay;
+    gPending.CarriedDelay = 0;
+    gPending.Count++;
+}
+
+// Starts the next batch unless one is still being written: a function result
+// if there is one, or else as many pending frames as can be coalesced.
+// Returns whether there is anything to write.
+
+bool fill_batch(void)
+{
+    struct message * message;
+    unsigned count = 0;
+
+    if (gPending.BatchStart < gPending.BatchEnd) {
+        return true;
+    }
+
+    message = peek_ring_slot(&gEmitter.Messages);
+    gPending.BatchIsMessage = message != NULL;
+
+    if (message != NULL) {
+        gPending.Batch[0].iov_base = message->Text;
+        gPending.Batch[0].iov_len = message->Length;
+        count = 1;
+    } else {
+        while (count < MAX_COALESCED_FRAMES && gPending.Count > 0) {
+            gPending.Batch[count].iov_base = gPending.Buffers[count];
+            gPending.Batch[count].iov_len = format_chart_data(&gPending.Frames[gPending.First], gPending.Buffers[count]);
+
+            gPending.First = (gPending.First + 1) % MAX_PENDING_FRAMES;
+            gPending.Count--;
+            count++;
+        }
+    }
+
+    gPending.BatchStart = 0;
+    gPending.BatchEnd = count;
+
+    return count > 0;
+}
+
+// Writes out the current batch. Returns false if the pipe filled up first or
+// the write failed.
+
+bool write_batch(void)
+{
+    struct iovec * iov;
+    ssize_t written;
+
+    while (gPending.BatchStart < gPending.BatchEnd) {
+        written = writev(STDOUT_FILENO, &gPending.Batch[gPending.BatchStart], gPending.BatchEnd - gPending.BatchStart);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                return false;
+            }
+
+            fprintf(stderr, "Unable to write chart data: %s\n", strerror(errno));
+            fail_emitter();
+            return false;
+        }
+
+        // Skip what was written, which may end partway through a frame.
+
+        while (gPending.BatchStart < gPending.BatchEnd && (size_t)written >= gPending.Batch[gPending.BatchStart].iov_len) {
+            written -= gPending.Batch[gPending.BatchStart++].iov_len;
+        }
+
+        if (written > 0) {
+            iov = &gPending.Batch[gPending.BatchStart];
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    if (gPending.BatchIsMessage) {
+        release_ring_slot(&gEmitter.Messages);
+    }
+
+    return true;
+}
+
+// Moves the queued samples to the pending frames, and writes out as much as
+// the pipe takes. Returns whether output is still waiting for the pipe.
+
+bool emit_queued_output(void)
+{
+    struct sample * sample;
+
+    while ((sample = peek_ring_slot(&gEmitter.Samples)) != NULL) {
+        add_pending_frame(sample);
+        release_ring_slot(&gEmitter.Samples);
+    }
+
+    while (fill_batch()) {
+        if (!write_batch()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void * run_emitter(void * context)
+{
+    struct pollfd descriptors[2];
+    bool blocked = false;
+    uint64_t wakeups;
+    uint64_t started;
+
+    (void)context;
+
+    descriptors[0].fd = gEmitter.Wakeup;
+    descriptors[0].events = POLLIN;
+    descriptors[1].events = POLLOUT;
+
+    while (!atomic_load(&gEmitter.Stopping) && !atomic_load(&gEmitter.Failed)) {
+
+        // Only wait for the pipe to drain while output is blocked on it.
+
+        descriptors[1].fd = blocked ? STDOUT_FILENO : -1;
+
+        if (poll(descriptors, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "Unable to wait for queued output\n");
+            fail_emitter();
+            break;
+        }
+
+        if ((descriptors[0].revents & POLLIN) && read(gEmitter.Wakeup, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "Unable to wait for queued output\n");
+            fail_emitter();
+            break;
+        }
+
+        started = clock_ns(CLOCK_MONOTONIC);
+        blocked = emit_queued_output();
+        atomic_store_explicit(&gEmitter.EmitTime, clock_ns(CLOCK_MONOTONIC) - started, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+int start_emitter(void)
+{
+    sigset_t signals;
+    sigset_t previous;
+    int status;
+
+    gEmitter.Wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    gEmitter.Failure = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (gEmitter.Wakeup < 0 || gEmitter.Failure < 0) {
+        return -1;
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        return -1;
+    }
+
+    if (fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    // Signals are handled by the main thread's event loop, so the emitter
+    // thread starts with all of them blocked.
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    status = pthread_create(&gEmitter.Thread, NULL, run_emitter, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Lets the emitter thread write out what the pipe still takes, and waits for
+// it.
+
+void stop_emitter(void)
+{
+    atomic_store(&gEmitter.Stopping, true);
+    wake_emitter();
+    pthread_join(gEmitter.Thread, NULL);
+}
+
+//
+// Export. With the export option, every sample is also published in a shared
+// memory file such as /dev/shm/chip.plugin, so that other local processes can
+// read the latest values by mapping it instead of polling the AXP209
+// themselves. The file holds, in host byte order:
+//   char      Magic[8]       EXPORT_MAGIC
+//   uint32_t  Size           size of the file in bytes
+//   uint32_t  NumDimensions
+//   { char Name[24]; int32_t Divisor; } Dimensions[NumDimensions]
+//   (padding to a 64 byte boundary)
+//   uint32_t  Sequence       even when stable, odd while being updated
+//   uint64_t  Timestamp      CLOCK_MONOTONIC time of the sample in ns
+//   uint64_t  IsValid        bit n set when Data[n] is valid
+//   int32_t   Data[NumDimensions], each to be divided by its Divisor
+// Updates are protected by a seqlock. A reader loads Sequence, retries while
+// it is odd, copies the values it needs, and retries if Sequence has changed
+// since, which takes no syscalls and never blocks the plugin.
+//
+
+#define EXPORT_MAGIC "CHIPSHM1"
+#define MAX_EXPORT_NAME_LENGTH 24
+
+struct shared_dimension
+{
+    char Name[MAX_EXPORT_NAME_LENGTH];
+    int32_t Divisor;
+};
+
+struct shared_export
+{
+    char Magic[8];
+    uint32_t Size;
+    uint32_t NumDimensions;
+    struct shared_dimension Dimensions[MaxDimensions];
+    alignas(CACHE_LINE_SIZE) atomic_uint Sequence;
+    uint64_t Timestamp;
+    uint64_t IsValid;
+    int32_t Data[MaxDimensions];
+};
+
+struct shared_export * gExport;
+char gExportPath[PATH_MAX];
+
+// Fills in the dimension table that starts the files shared with other
+// processes.
+
+void describe_dimensions(struct shared_dimension * dimensions, uint32_t count)
+{
+    enum Dimensions index;
+
+    memset(dimensions, 0, count * sizeof(dimensions[0]));
+
+    for (index = 0; index < count; index++) {
+        snprintf(dimensions[index].Name, sizeof(dimensions[index].Name), "%s", gDimensionDefinitions[index].Name);
+        dimensions[index].Divisor = gDimensionDefinitions[index].Divisor;
+    }
+}
+
+int start_export(void)
+{
+    struct shared_export * export;
+    int fd;
+
+    fd = open(gExportPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(*export)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    export = mmap(NULL, sizeof(*export), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (export == MAP_FAILED) {
+        return -1;
+    }
+
+    // The magic is written last, so that readers ignore a half-initialized
+    // file.
+
+    memset(export->Magic, 0, sizeof(export->Magic));
+    atomic_thread_fence(memory_order_release);
+
+    export->Size = sizeof(*export);
+    export->NumDimensions = MaxDimensions;
+    describe_dimensions(export->Dimensions, MaxDimensions);
+
+    atomic_store_explicit(&export->Sequence, 0, memory_order_relaxed);
+    export->Timestamp = 0;
+    export->IsValid = 0;
+
+    atomic_thread_fence(memory_order_release);
+    memcpy(export->Magic, EXPORT_MAGIC, sizeof(export->Magic));
+
+    gExport = export;
+    return 0;
+}
+
+void export_sample(uint64_t timestamp)
+{
+    unsigned sequence;
+
+    if (gExport == NULL) {
+        return;
+    }
+
+    sequence = atomic_load_explicit(&gExport->Sequence, memory_order_relaxed);
+    atomic_store_explicit(&gExport->Sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    gExport->Timestamp = timestamp;
+    gExport->IsValid = gIsValid;
+    memcpy(gExport->Data, gData, sizeof(gExport->Data));
+
+    atomic_store_explicit(&gExport->Sequence, sequence + 2, memory_order_release);
+}
+
+//
+// History and store. Samples can be kept in series files, memory-mapped rings
+// with one column per sensor dimension, so that local tools can compute
+// windows such as the average discharge over the last 10 minutes, or the
+// battery level over the last 90 days, by scanning contiguous memory instead
+// of querying netdata or the bus. The plugin's own dimensions and the
+// oversampling minimums and maximums are not kept.
+//
+// The history option keeps the last history-length samples in a single series,
+// meant for tmpfs and updated in place as samples arrive. The store option
+// keeps three series in a directory meant for flash: the raw samples over a
+// short window, and min/avg/max rollups per minute and per hour over longer
+// ones. A query over months then reads a few kilobytes of hourly rollups
+// instead of millions of samples. Since every slot touches a page of each
+// column, the store is mapped privately and its new slots are written back
+// with pwrite() every store-flush seconds, and rollups are built in memory and
+// only written once their interval is over, so that the flash is written
+// rarely and in large chunks.
+//
+// Each series file has a fixed size, allocated up front, and holds in host
+// byte order:
+//   char      Magic[8]       SERIES_MAGIC
+//   uint32_t  NumDimensions
+//   uint32_t  Capacity       number of slots in each column
+//   uint32_t  Resolution     seconds per slot, or 0 for one slot per sample
+//   uint32_t  NumStatistics  columns per dimension: 1 (value), or 3 (min,
+//                            avg, max) for rollups
+//   { char Name[24]; int32_t Divisor; } Dimensions[NumDimensions]
+//   uint8_t   Widths[NumDimensions]  bytes per value: 2 or 4
+//   (padding to a 64 byte boundary)
+//   uint64_t  Written        number of slots written so far
+//   (padding to a 64 byte boundary)
+//   uint64_t  Timestamps[Capacity]   CLOCK_REALTIME in ns of the sample, or of
+//                                    the start of the rollup interval
+//   uint32_t  Samples[Capacity]      number of samples in the slot, for
+//                                    rollups only
+//   for each dimension, NumStatistics columns of Capacity int16_t or int32_t
+//   values, SERIES_INVALID (INT16_MIN or INT32_MIN) if not valid
+// A dimension is stored in 16 bits when the range of its register field
+// fits, and values outside of it, which only the sysfs backend could report,
+// are clamped. Slot n is at index n % Capacity of every column, so the latest one is at
+// (Written - 1) % Capacity. A slot is filled before Written is incremented,
+// and a reader that took Written before scanning can check it again
+// afterwards to discard slots overwritten in the meantime.
+//
+// A file whose header matches is appended to, so that the series survive
+// restarts of the plugin. The rollups in progress are written out when the
+// plugin is stopped with SIGTERM or SIGINT, and if it starts again within
+// their interval, they resume from their stored average, weighted as if all
+// their samples had been valid.
+//
+
+#define SERIES_MAGIC "CHIPSER1"
+#define SERIES_INVALID INT32_MIN
+#define SERIES_INVALID16 INT16_MIN
+#define NUM_STORED_DIMENSIONS NUM_SENSOR_DIMENSIONS
+#define DEFAULT_HISTORY_LENGTH 3600
+#define MAX_HISTORY_LENGTH 2678400      // 31 days of samples at 1 s
+#define SERIES_LENGTH_ALIGNMENT (CACHE_LINE_SIZE / sizeof(int16_t))
+#define STORE_RAW_LENGTH 3600           // 1 hour of samples at 1 s
+#define STORE_MINUTE_LENGTH 10080       // 1 week
+#define STORE_HOUR_LENGTH 26352         // 3 years
+#define DEFAULT_STORE_FLUSH_INTERVAL 600
+#define MAX_STORE_FLUSH_INTERVAL 86400
+
+enum Statistics
+{
+    StatisticMin,
+    StatisticAvg,
+    StatisticMax,
+    NUM_ROLLUP_STATISTICS
+};
+
+struct series_header
+{
+    char Magic[8];
+    uint32_t NumDimensions;
+    uint32_t Capacity;
+    uint32_t Resolution;
+    uint32_t NumStatistics;
+    struct shared_dimension Dimensions[NUM_STORED_DIMENSIONS];
+    uint8_t Widths[NUM_STORED_DIMENSIONS];
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t Written;
+    alignas(CACHE_LINE_SIZE) uint64_t Timestamps[];
+};
+
+struct series
+{
+    const char * Name;
+    uint32_t Length;
+    uint32_t Resolution;
+    uint32_t NumStatistics;
+    struct series_header * Header;
+    size_t Size;
+    uint32_t * Samples;
+    uint8_t * Data;
+    size_t Offsets[NUM_STORED_DIMENSIONS];
+
+    // File of a privately mapped series, and the number of slots written back
+    // to it so far
+
+    int Fd;
+    uint64_t Flushed;
+
+    // Rollup in progress, and whether it has a slot yet
+
+    uint64_t Interval;
+    uint32_t NumSamples;
+    bool Stored;
+    int64_t Sums[NUM_STORED_DIMENSIONS];
+    uint32_t Counts[NUM_STORED_DIMENSIONS];
+    int32_t Minimums[NUM_STORED_DIMENSIONS];
+    int32_t Maximums[NUM_STORED_DIMENSIONS];
+};
+
+struct series gHistory = { .Name = "history", .Length = DEFAULT_HISTORY_LENGTH, .Resolution = 0, .NumStatistics = 1 };
+char gHistoryPath[PATH_MAX];
+
+struct
+{
+    char Directory[PATH_MAX];
+    uint32_t FlushInterval;
+    uint64_t LastFlush;
+    struct series Tiers[3];
+} gStore = {
+    .FlushInterval = DEFAULT_STORE_FLUSH_INTERVAL,
+    .Tiers = {
+        { .Name = "raw",    .Length = STORE_RAW_LENGTH,    .Resolution = 0,    .NumStatistics = 1 },
+        { .Name = "minute", .Length = STORE_MINUTE_LENGTH, .Resolution = 60,   .NumStatistics = NUM_ROLLUP_STATISTICS },
+        { .Name = "hour",   .Length = STORE_HOUR_LENGTH,   .Resolution = 3600, .NumStatistics = NUM_ROLLUP_STATISTICS },
+    },
+};
+
+#define NUM_STORE_TIERS (sizeof(gStore.Tiers) / sizeof(gStore.Tiers[0]))
+
+// Returns the range of the scaled integers of a sensor dimension.
+
+void get_dimension_range(enum Dimensions index, int64_t * low, int64_t * high)
+{
+    const struct register_field * field = &gRegisterMap[index];
+    int64_t first = field->Offset;
+    int64_t last = (int64_t)field->Mask * field->Multiplier + field->Offset;
+    int64_t bases[2];
+    int64_t products[4];
+    uint8_t corner;
+
+    *low = first < last ? first : last;
+    *high = first < last ? last : first;
+
+    if (field->Base == EMPTY_DIM) {
+        return;
+    }
+
+    get_dimension_range(field->Base, &bases[0], &bases[1]);
+
+    products[0] = *low * bases[0];
+    products[1] = *low * bases[1];
+    products[2] = *high * bases[0];
+    products[3] = *high * bases[1];
+
+    *low = *high = products[0];
+
+    for (corner = 1; corner < 4; corner++) {
+        *low = products[corner] < *low ? products[corner] : *low;
+        *high = products[corner] > *high ? products[corner] : *high;
+    }
+}
+
+uint8_t get_stored_width(enum Dimensions index)
+{
+    int64_t low;
+    int64_t high;
+
+    get_dimension_range(index, &low, &high);
+
+    return low > SERIES_INVALID16 && high <= INT16_MAX ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+size_t get_series_size(const struct series_header * header)
+{
+    size_t size = sizeof(*header) + header->Capacity * (sizeof(uint64_t) + (header->NumStatistics > 1 ? sizeof(uint32_t) : 0));
+    uint32_t index;
+
+    for (index = 0; index < header->NumDimensions; index++) {
+        size += (size_t)header->Capacity * header->NumStatistics * header->Widths[index];
+    }
+
+    return size;
+}
+
+// Locates the columns of a mapped series.
+
+void lay_out_series(struct series * series)
+{
+    struct series_header * header = series->Header;
+    size_t offset = 0;
+    uint32_t index;
+
+    series->Samples = (uint32_t *)(header->Timestamps + header->Capacity);
+    series->Data = (uint8_t *)series->Samples;
+
+    if (header->NumStatistics > 1) {
+        series->Data += header->Capacity * sizeof(uint32_t);
+    } else {
+        series->Samples = NULL;
+    }
+
+    for (index = 0; index < header->NumDimensions; index++) {
+        series->Offsets[index] = offset;
+        offset += (size_t)header->Capacity * header->NumStatistics * header->Widths[index];
+    }
+}
+
+void * series_column(const struct series * series, uint32_t index, enum Statistics statistic)
+{
+    return series->Data + series->Offsets[index] + (size_t)statistic * series->Header->Capacity * series->Header->Widths[index];
+}
+
+int32_t get_series_value(const struct series * series, uint32_t index, enum Statistics statistic, uint32_t slot)
+{
+    int16_t value;
+
+    if (series->Header->Widths[index] == sizeof(int32_t)) {
+        return ((const int32_t *)series_column(series, index, statistic))[slot];
+    }
+
+    value = ((const int16_t *)series_column(series, index, statistic))[slot];
+    return value != SERIES_INVALID16 ? value : SERIES_INVALID;
+}
+
+void set_series_value(const struct series * series, uint32_t index, enum Statistics statistic, uint32_t slot, int32_t value)
+{
+    if (series->Header->Widths[index] == sizeof(int32_t)) {
+        ((int32_t *)series_column(series, index, statistic))[slot] = value;
+    } else if (value == SERIES_INVALID) {
+        ((int16_t *)series_column(series, index, statistic))[slot] = SERIES_INVALID16;
+    } else {
+        value = value < -INT16_MAX ? -INT16_MAX : value;
+        value = value > INT16_MAX ? INT16_MAX : value;
+        ((int16_t *)series_column(series, index, statistic))[slot] = value;
+    }
+}
+
+uint64_t oldest_series_slot(const struct series * series, uint64_t written)
+{
+    return written > series->Header->Capacity ? written - series->Header->Capacity : 0;
+}
+
+// Picks up the rollup of the latest slot, so that it carries on if the
+// interval is not over yet.
+
+void resume_rollup(struct series * series)
+{
+    struct series_header * header = series->Header;
+    enum Dimensions index;
+    uint64_t written = atomic_load_explicit(&header->Written, memory_order_relaxed);
+    uint64_t now = clock_ns(CLOCK_REALTIME);
+    uint32_t slot;
+    int32_t average;
+
+    if (series->Resolution == 0 || written == 0) {
+        return;
+    }
+
+    slot = (written - 1) % header->Capacity;
+
+    if (header->Timestamps[slot] != now - now % (series->Resolution * NSEC_PER_SEC)) {
+        return;
+    }
+
+    series->Interval = header->Timestamps[slot];
+    series->NumSamples = series->Samples[slot];
+    series->Stored = true;
+
+    for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+        average = get_series_value(series, index, StatisticAvg, slot);
+
+        series->Counts[index] = average != SERIES_INVALID ? series->Samples[slot] : 0;
+        series->Sums[index] = (int64_t)average * series->Counts[index];
+        series->Minimums[index] = get_series_value(series, index, StatisticMin, slot);
+        series->Maximums[index] = get_series_value(series, index, StatisticMax, slot);
+    }
+}
+
+// Maps a series file, privately if its changes are to be written back with
+// flush_series() rather than as they are made.
+
+int open_series(struct series * series, const char * path, bool private)
+{
+    struct series_header expected;
+    struct series_header existing;
+    struct series_header * header;
+    struct stat status;
+    enum Dimensions index;
+    size_t size;
+    int fd;
+
+    // Round the columns up to whole cache lines so that each one starts on
+    // its own.
+
+    memset(&expected, 0, sizeof(expected));
+    expected.NumDimensions = NUM_STORED_DIMENSIONS;
+    expected.Capacity = (series->Length + SERIES_LENGTH_ALIGNMENT - 1) / SERIES_LENGTH_ALIGNMENT * SERIES_LENGTH_ALIGNMENT;
+    expected.Resolution = series->Resolution;
+    expected.NumStatistics = series->NumStatistics;
+    describe_dimensions(expected.Dimensions, NUM_STORED_DIMENSIONS);
+
+    for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+        expected.Widths[index] = get_stored_width(index);
+    }
+
+    size = get_series_size(&expected);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Allocate the whole file now, so that running out of space fails here
+    // rather than with a SIGBUS while writing to the mapping.
+
+    if (fstat(fd, &status) < 0 ||
+        ((size_t)status.st_size != size && (ftruncate(fd, 0) < 0 || posix_fallocate(fd, 0, size) != 0))) {
+        close(fd);
+        return -1;
+    }
+
+    // Start over unless the file was written with the same layout, writing
+    // the magic last so that readers ignore a half-initialized file.
+
+    if ((size_t)status.st_size != size ||
+        pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+        memcmp(existing.Magic, SERIES_MAGIC, sizeof(existing.Magic)) != 0 ||
+        memcmp((char *)&existing + sizeof(existing.Magic), (char *)&expected + sizeof(expected.Magic),
+               offsetof(struct series_header, Written) - sizeof(expected.Magic)) != 0) {
+        if (pwrite(fd, expected.Magic, sizeof(expected.Magic), 0) != sizeof(expected.Magic) ||
+            pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected) ||
+            pwrite(fd, SERIES_MAGIC, sizeof(expected.Magic), 0) != sizeof(expected.Magic)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+
+    if (header == MAP_FAILED || !private) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (header == MAP_FAILED) {
+        return -1;
+    }
+
+    series->Header = header;
+    series->Size = size;
+    series->Fd = fd;
+    series->Flushed = atomic_load_explicit(&header->Written, memory_order_relaxed);
+
+    lay_out_series(series);
+    resume_rollup(series);
+    return 0;
+}
+
+void close_series(struct series * series)
+{
+    if (series->Header != NULL) {
+        munmap(series->Header, series->Size);
+        series->Header = NULL;
+    }
+
+    if (series->Fd >= 0) {
+        close(series->Fd);
+        series->Fd = -1;
+    }
+}
+
+int write_series_range(const struct series * series, const void * start, size_t length)
+{
+    off_t offset = (const char *)start - (const char *)series->Header;
+
+    return pwrite(series->Fd, start, length, offset) == (ssize_t)length ? 0 : -1;
+}
+
+// Writes the slots added to a privately mapped series since the last flush
+// back to its file, and Written last, so that readers of the file never count
+// a slot that is not there yet.
+
+int flush_series(struct series * series)
+{
+    struct series_header * header = series->Header;
+    enum Dimensions index;
+    uint32_t statistic;
+    uint64_t written;
+    uint64_t slot;
+    uint32_t start;
+    uint32_t count;
+
+    if (header == NULL || series->Fd < 0) {
+        return 0;
+    }
+
+    written = atomic_load_explicit(&header->Written, memory_order_relaxed);
+    slot = series->Flushed > oldest_series_slot(series, written) ? series->Flushed : oldest_series_slot(series, written);
+
+    for (; slot < written; slot += count) {
+        start = slot % header->Capacity;
+        count = header->Capacity - start < written - slot ? header->Capacity - start : written - slot;
+
+        if (write_series_range(series, &header->Timestamps[start], count * sizeof(uint64_t)) < 0 ||
+            (series->Samples != NULL && write_series_range(series, &series->Samples[start], count * sizeof(uint32_t)) < 0)) {
+            return -1;
+        }
+
+        for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+            for (statistic = 0; statistic < series->NumStatistics; statistic++) {
+                if (write_series_range(series, (uint8_t *)series_column(series, index, statistic) + (size_t)start * header->Widths[index],
+                                       count * header->Widths[index]) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (write_series_range(series, (const void *)&header->Written, sizeof(header->Written)) < 0) {
+        return -1;
+    }
+
+    series->Flushed = written;
+    return 0;
+}
+
+int open_store(void)
+{
+    char path[PATH_MAX];
+    uint8_t tier;
+
+    if (mkdir(gStore.Directory, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    for (tier = 0; tier < NUM_STORE_TIERS; tier++) {
+        if (snprintf(path, sizeof(path), "%s/%s", gStore.Directory, gStore.Tiers[tier].Name) >= (int)sizeof(path) ||
+            open_series(&gStore.Tiers[tier], path, true) < 0) {
+            return -1;
+        }
+    }
+
+    gStore.LastFlush = clock_ns(CLOCK_MONOTONIC);
+    return 0;
+}
+
+void flush_store(uint64_t now)
+{
+    uint8_t tier;
+
+    gStore.LastFlush = now;
+
+    for (tier = 0; tier < NUM_STORE_TIERS; tier++) {
+        if (flush_series(&gStore.Tiers[tier]) < 0) {
+            fprintf(stderr, "Unable to write to %s/%s, storing it stopped\n", gStore.Directory, gStore.Tiers[tier].Name);
+            close_series(&gStore.Tiers[tier]);
+        }
+    }
+}
+
+// Writes the rollup in progress to its slot, taking a new one unless it has
+// been written before.
+
+void write_rollup(struct series * series)
+{
+    struct series_header * header = series->Header;
+    enum Dimensions index;
+    uint64_t written;
+    uint32_t slot;
+    bool valid;
+
+    if (header == NULL || series->NumSamples == 0) {
+        return;
+    }
+
+    written = atomic_load_explicit(&header->Written, memory_order_relaxed);
+    slot = (series->Stored ? written - 1 : written) % header->Capacity;
+
+    header->Timestamps[slot] = series->Interval;
+    series->Samples[slot] = series->NumSamples;
+
+    for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+        valid = series->Counts[index] > 0;
+
+        set_series_value(series, index, StatisticMin, slot, valid ? series->Minimums[index] : SERIES_INVALID);
+        set_series_value(series, index, StatisticAvg, slot, valid ? series->Sums[index] / series->Counts[index] : SERIES_INVALID);
+        set_series_value(series, index, StatisticMax, slot, valid ? series->Maximums[index] : SERIES_INVALID);
+    }
+
+    // A slot written again has to be flushed again.
+
+    if (series->Stored) {
+        series->Flushed = series->Flushed < written - 1 ? series->Flushed : written - 1;
+    } else {
+        atomic_store_explicit(&header->Written, written + 1, memory_order_release);
+        series->Stored = true;
+    }
+}
+
+void add_series_sample(struct series * series, uint64_t timestamp)
+{
+    struct series_header * header = series->Header;
+    enum Dimensions index;
+    uint64_t written;
+    uint64_t interval;
+    uint32_t slot;
+    int32_t value;
+
+    if (header == NULL) {
+        return;
+    }
+
+    if (series->Resolution == 0) {
+        written = atomic_load_explicit(&header->Written, memory_order_relaxed);
+        slot = written % header->Capacity;
+
+        header->Timestamps[slot] = timestamp;
+
+        for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+            set_series_value(series, index, 0, slot, is_dimension_valid(index) ? gData[index] : SERIES_INVALID);
+        }
+
+        atomic_store_explicit(&header->Written, written + 1, memory_order_release);
+        return;
+    }
+
+    // Fold the sample into the rollup of its interval, writing out the
+    // previous interval's once it is over.
+
+    interval = timestamp - timestamp % (series->Resolution * NSEC_PER_SEC);
+
+    if (series->NumSamples > 0 && interval != series->Interval) {
+        write_rollup(series);
+        series->NumSamples = 0;
+    }
+
+    if (series->NumSamples == 0) {
+        series->Interval = interval;
+        series->Stored = false;
+        memset(series->Sums, 0, sizeof(series->Sums));
+        memset(series->Counts, 0, sizeof(series->Counts));
+    }
+
+    series->NumSamples++;
+
+    for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+        if (!is_dimension_valid(index)) {
+            continue;
+        }
+
+        value = gData[index];
+
+        if (series->Counts[index]++ == 0) {
+            series->Minimums[index] = series->Maximums[index] = value;
+        } else if (value < series->Minimums[index]) {
+            series->Minimums[index] = value;
+        } else if (value > series->Maximums[index]) {
+            series->Maximums[index] = value;
+        }
+
+        series->Sums[index] += value;
+    }
+}
+
+void add_stored_sample(uint64_t now, uint64_t timestamp)
+{
+    uint8_t tier;
+
+    add_series_sample(&gHistory, timestamp);
+
+    for (tier = 0; tier < NUM_STORE_TIERS; tier++) {
+        add_series_sample(&gStore.Tiers[tier], timestamp);
+    }
+
+    if (gStore.Directory[0] != '\0' && now - gStore.LastFlush >= gStore.FlushInterval * NSEC_PER_SEC) {
+        flush_store(now);
+    }
+}
+
+// Writes out the rollups in progress and everything not flushed yet, when the
+// plugin stops.
+
+void stop_store(void)
+{
+    uint8_t tier;
+
+    for (tier = 0; tier < NUM_STORE_TIERS; tier++) {
+        write_rollup(&gStore.Tiers[tier]);
+    }
+
+    flush_store(clock_ns(CLOCK_MONOTONIC));
+}
+
+//
+// Sample log. With the log option, the samples are kept indefinitely in a
+// compact append-only file meant for flash. Each sample is encoded against
+// the previous one and collected in an in-memory block, and whole blocks are
+// appended with a single write() every log-flush seconds or when they fill
+// up, so that the flash is written rarely and in large chunks. The file holds,
+// in host byte order:
+//   char      Magic[8]       LOG_MAGIC
+//   uint32_t  NumDimensions
+//   { char Name[24]; int32_t Divisor; } Dimensions[NumDimensions]
+// followed by blocks of
+//   uint32_t  length of the records in bytes
+//   records
+// and each record is a sequence of LEB128 varints:
+//   zigzag    CLOCK_REALTIME in ms, minus that of the previous record
+//   mask      validity bits that flipped since the previous record
+//   mask      valid dimensions whose value changed
+//   zigzag    for each changed dimension in index order, the new value minus
+//             the previous one
+// Each block starts over from a timestamp, validity and values of 0, so that
+// it can be decoded on its own. The plugin's own dimensions are not logged.
+//
+// A block cut short by a crash is dropped when the log is reopened.
+//
+
+#define LOG_MAGIC "CHIPLOG1"
+#define LOG_BLOCK_SIZE 16384
+#define MAX_VARINT_LENGTH 10
+#define MAX_LOG_RECORD_LENGTH ((3 + MaxDimensions) * MAX_VARINT_LENGTH)
+#define DEFAULT_LOG_FLUSH_INTERVAL 600
+#define MAX_LOG_FLUSH_INTERVAL 86400
+#define DIMENSION_MASK(name, ...) | DIMENSION_BIT(name)
+#define LOGGED_DIMENSIONS (~(0 PLUGIN_DIMENSIONS(DIMENSION_MASK)) & (DIMENSION_BIT(MaxDimensions - 1) * 2 - 1))
+
+struct log_header
+{
+    char Magic[8];
+    uint32_t NumDimensions;
+    struct shared_dimension Dimensions[MaxDimensions];
+};
+
+struct
+{
+    int Fd;
+    uint32_t FlushInterval;
+    uint64_t LastFlush;
+    int64_t Timestamp;
+    uint64_t IsValid;
+    int32_t Data[MaxDimensions];
+    size_t Length;
+    uint8_t Block[LOG_BLOCK_SIZE];
+    char Path[PATH_MAX];
+} gLog = { .Fd = -1, .FlushInterval = DEFAULT_LOG_FLUSH_INTERVAL, .Length = sizeof(uint32_t) };
+
+uint8_t * put_varint(uint8_t * cursor, uint64_t value)
+{
+    while (value >= 0x80) {
+        *cursor++ = value | 0x80;
+        value >>= 7;
+    }
+
+    *cursor++ = value;
+    return cursor;
+}
+
+uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+// Returns the size of the file without any block cut short at its end.
+
+off_t find_log_end(int fd, off_t size)
+{
+    off_t offset = sizeof(struct log_header);
+    uint32_t length;
+
+    while (size - offset >= (off_t)sizeof(length)) {
+        if (pread(fd, &length, sizeof(length), offset) != sizeof(length) ||
+            length > LOG_BLOCK_SIZE - sizeof(length) ||
+            size - offset - (off_t)sizeof(length) < length) {
+            break;
+        }
+
+        offset += sizeof(length) + length;
+    }
+
+    return offset;
+}
+
+int start_log(void)
+{
+    struct log_header expected;
+    struct log_header existing;
+    struct stat status;
+    off_t end;
+
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.Magic, LOG_MAGIC, sizeof(expected.Magic));
+    expected.NumDimensions = MaxDimensions;
+    describe_dimensions(expected.Dimensions, MaxDimensions);
+
+    gLog.Fd = open(gLog.Path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (gLog.Fd < 0 || fstat(gLog.Fd, &status) < 0) {
+        return -1;
+    }
+
+    if (status.st_size == 0) {
+        if (write(gLog.Fd, &expected, sizeof(expected)) != sizeof(expected)) {
+            return -1;
+        }
+    } else {
+        if (pread(gLog.Fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+            memcmp(&existing, &expected, sizeof(expected)) != 0) {
+            fprintf(stderr, "%s was not written by this version of the plugin\n", gLog.Path);
+            return -1;
+        }
+
+        end = find_log_end(gLog.Fd, status.st_size);
+        if (end != status.st_size && ftruncate(gLog.Fd, end) < 0) {
+            return -1;
+        }
+    }
+
+    gLog.LastFlush = clock_ns(CLOCK_MONOTONIC);
+    return 0;
+}
+
+void flush_log(uint64_t now)
+{
+    uint32_t length = gLog.Length - sizeof(length);
+
+    gLog.LastFlush = now;
+
+    if (gLog.Fd < 0 || length == 0) {
+        return;
+    }
+
+    memcpy(gLog.Block, &length, sizeof(length));
+
+    if (write(gLog.Fd, gLog.Block, gLog.Length) != (ssize_t)gLog.Length) {
+        fprintf(stderr, "Unable to write to %s, logging stopped\n", gLog.Path);
+        close(gLog.Fd);
+        gLog.Fd = -1;
+    }
+
+    gLog.Length = sizeof(length);
+}
+
+void add_log_sample(uint64_t now, uint64_t timestamp)
+{
+    enum Dimensions index;
+    uint64_t valid;
+    uint64_t changed = 0;
+    uint8_t * cursor;
+    int64_t milliseconds = timestamp / NSEC_PER_MSEC;
+
+    if (gLog.Fd < 0) {
+        return;
+    }
+
+    if (gLog.Length + MAX_LOG_RECORD_LENGTH > sizeof(gLog.Block)) {
+        flush_log(now);
+    }
+
+    if (gLog.Length == sizeof(uint32_t)) {
+        gLog.Timestamp = 0;
+        gLog.IsValid = 0;
+        memset(gLog.Data, 0, sizeof(gLog.Data));
+    }
+
+    valid = gIsValid & LOGGED_DIMENSIONS;
+
+    for (index = 0; index < MaxDimensions; index++) {
+        if ((valid & DIMENSION_BIT(index)) && gData[index] != gLog.Data[index]) {
+            changed |= DIMENSION_BIT(index);
+        }
+    }
+
+    cursor = gLog.Block + gLog.Length;
+    cursor = put_varint(cursor, zigzag(milliseconds - gLog.Timestamp));
+    cursor = put_varint(cursor, valid ^ gLog.IsValid);
+    cursor = put_varint(cursor, changed);
+
+    for (index = 0; index < MaxDimensions; index++) {
+        if (changed & DIMENSION_BIT(index)) {
+            cursor = put_varint(cursor, zigzag((int64_t)gData[index] - gLog.Data[index]));
+            gLog.Data[index] = gData[index];
+        }
+    }
+
+    gLog.Length = cursor - gLog.Block;
+    gLog.Timestamp = milliseconds;
+    gLog.IsValid = valid;
+
+    if (now - gLog.LastFlush >= gLog.FlushInterval * NSEC_PER_SEC) {
+        flush_log(now);
+    }
+}
+
+//
+// Event loop. Every input of the plugin (the collection timer, netdata's
+// commands on stdin, and any additional descriptors) is an event source
+// registered with an epoll instance, and run_event_loop() dispatches to their
+// handlers as soon as they become ready, so nothing waits behind a sleep.
+//
+
+#define MAX_EVENT_SOURCES 8
+
+struct event_source;
+typedef void (*event_handler_t)(struct event_source * source, uint32_t events);
+
+struct event_source
+{
+    int Fd;
+    event_handler_t Handler;
+    void * Context;
+};
+
+struct event_loop
+{
+    int Epoll;
+    bool Running;
+    uint8_t NumSources;
+    struct event_source Sources[MAX_EVENT_SOURCES];
+};
+
+struct event_loop gEventLoop;
+
+int create_event_loop(struct event_loop * loop)
+{
+    loop->Epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->Running = false;
+    loop->NumSources = 0;
+
+    return loop->Epoll;
+}
+
+int add_event_source(struct event_loop * loop, int fd, uint32_t events, event_handler_t handler, void * context)
+{
+    struct epoll_event event;
+    struct event_source * source;
+
+    if (loop->NumSources == MAX_EVENT_SOURCES) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    source = &loop->Sources[loop->NumSources];
+    source->Fd = fd;
+    source->Handler = handler;
+    source->Context = context;
+
+    event.events = events;
+    event.data.ptr = source;
+
+    if (epoll_ctl(loop->Epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return -1;
+    }
+
+    loop->NumSources++;
+    return 0;
+}
+
+void remove_event_source(struct event_loop * loop, struct event_source * source)
+{
+    // The slot is left in place since epoll holds a pointer to it; it just
+    // no longer receives events.
+
+    epoll_ctl(loop->Epoll, EPOLL_CTL_DEL, source->Fd, NULL);
+    source->Handler = NULL;
+}
+
+void run_event_loop(struct event_loop * loop)
+{
+    struct epoll_event events[MAX_EVENT_SOURCES];
+    struct event_source * source;
+    int count;
+    int index;
+
+    loop->Running = true;
+
+    while (loop->Running) {
+        count = epoll_wait(loop->Epoll, events, MAX_EVENT_SOURCES, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "Unable to wait for events\n");
+            exit(1);
+        }
+
+        for (index = 0; index < count && loop->Running; index++) {
+            source = events[index].data.ptr;
+            if (source->Handler != NULL) {
+                source->Handler(source, events[index].events);
+            }
+        }
+    }
+}
+
+//
+// Tick scheduler. A timerfd fires at absolute CLOCK_MONOTONIC deadlines spaced
+// exactly gUpdateEvery seconds apart, with the first one aligned to a wall-
+// clock multiple of the period, so collection neither drifts nor depends on
+// how long a tick took. When a tick overruns past the following deadline(s),
+// the timer reports several expirations at once; the extra ones are skipped
+// and counted rather than run late.
+//
+// Lateness is how long after its deadline a tick actually woke up. Jitter is
+// the smoothed variation of the lateness between ticks, following the
+// interarrival jitter estimator of RFC 3550.
+//
+// Each tick also times its own gather stage, and reports the time the emitter
+// thread last took to write out its queued frames. The CPU usage covers
+// everything the plugin did since the previous tick, oversampling, commands
+// and the emitter thread included.
+//
+
+struct
+{
+    int Timer;
+    uint64_t Deadline;
+    uint64_t Period;
+    uint64_t Lateness;
+    int64_t Jitter;
+    uint32_t Skipped;
+    uint64_t LastCollection;
+    uint64_t LastCpuTime;
+} gScheduler;
+
+void save_scheduler_data(void)
+{
+    save_data(latenessus, gScheduler.Lateness / NSEC_PER_USEC);
+    save_data(jitterus, gScheduler.Jitter / NSEC_PER_USEC);
+    save_data(skippedticks, gScheduler.Skipped);
+    save_data(droppedframes, atomic_load_explicit(&gEmitter.Dropped, memory_order_relaxed));
+}
+
+void run_collection_tick(bool scheduled)
+{
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    uint64_t realtime = clock_ns(CLOCK_REALTIME);
+    uint64_t cputime = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t gathered;
+    uint64_t delta;
+
+    gather_chart_data(scheduled);
+    gathered = clock_ns(CLOCK_MONOTONIC);
+
+    save_data(gathertimeus, (gathered - now) / NSEC_PER_USEC);
+
+    // Calculate the time since the last frame in microseconds. This is passed
+    // to netdata on all but the first frame to provide an accurate collection
+    // time.
+
+    if (gScheduler.LastCollection != 0) {
+        delta = (now - gScheduler.LastCollection) / NSEC_PER_USEC;
+
+        save_data(emittimeus, atomic_load_explicit(&gEmitter.EmitTime, memory_order_relaxed) / NSEC_PER_USEC);
+        save_data(cpuusage, (cputime - gScheduler.LastCpuTime) * 1000000 / (now - gScheduler.LastCollection));
+    } else {
+        delta = 0;
+    }
+
+    gScheduler.LastCollection = now;
+    gScheduler.LastCpuTime = cputime;
+
+    finish_record(now);
+    save_scheduler_data();
+    export_sample(now);
+    add_stored_sample(now, realtime);
+    add_log_sample(now, realtime);
+
+    queue_sample(delta);
+}
+
+void on_tick_timer(struct event_source * source, uint32_t events)
+{
+    uint64_t expirations;
+    uint64_t lateness;
+    int64_t variation;
+    uint64_t now;
+
+    (void)events;
+
+    if (read(source->Fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    // Service only the most recent expiration.
+
+    gScheduler.Deadline += (expirations - 1) * gScheduler.Period;
+    gScheduler.Skipped += expirations - 1;
+
+    now = clock_ns(CLOCK_MONOTONIC);
+    lateness = now > gScheduler.Deadline ? now - gScheduler.Deadline : 0;
+
+    variation = (int64_t)lateness - (int64_t)gScheduler.Lateness;
+    if (variation < 0) {
+        variation = -variation;
+    }
+
+    gScheduler.Jitter += (variation - gScheduler.Jitter) / 16;
+    gScheduler.Lateness = lateness;
+    gScheduler.Deadline += gScheduler.Period;
+
+    run_collection_tick(true);
+}
+
+int start_scheduler(struct event_loop * loop)
+{
+    struct itimerspec schedule;
+    uint64_t realtime = clock_ns(CLOCK_REALTIME);
+    uint64_t monotonic = clock_ns(CLOCK_MONOTONIC);
+
+    gScheduler.Period = gUpdateEvery * NSEC_PER_SEC;
+    gScheduler.Deadline = monotonic + gScheduler.Period - realtime % gScheduler.Period;
+    gScheduler.Lateness = 0;
+    gScheduler.Jitter = 0;
+    gScheduler.Skipped = 0;
+    gScheduler.LastCollection = 0;
+
+    gScheduler.Timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (gScheduler.Timer < 0) {
+        return -1;
+    }
+
+    schedule.it_value.tv_sec = gScheduler.Deadline / NSEC_PER_SEC;
+    schedule.it_value.tv_nsec = gScheduler.Deadline % NSEC_PER_SEC;
+    schedule.it_interval.tv_sec = gUpdateEvery;
+    schedule.it_interval.tv_nsec = 0;
+
+    if (timerfd_settime(gScheduler.Timer, TFD_TIMER_ABSTIME, &schedule, NULL) < 0) {
+        return -1;
+    }
+
+    return add_event_source(loop, gScheduler.Timer, EPOLLIN, on_tick_timer, NULL);
+}
+
+void on_sample_timer(struct event_source * source, uint32_t events)
+{
+    uint64_t expirations;
+
+    (void)events;
+
+    if (read(source->Fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    // Samples wait for ticks to bring a bus that is down back up.
+
+    if (gBackend == BackendSysfs) {
+        read_sysfs_attributes(gSamplePlan.Dimensions);
+    } else if (!gBusDown && read_registers(&gSamplePlan) == 0) {
+        decode_registers(&gSamplePlan);
+    } else {
+        return;
+    }
+
+    accumulate_samples();
+}
+
+int add_periodic_timer(struct event_loop * loop, uint16_t rate, event_handler_t handler)
+{
+    struct itimerspec schedule;
+    uint64_t period = NSEC_PER_SEC / rate;
+    int timer;
+
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0) {
+        return -1;
+    }
+
+    schedule.it_interval.tv_sec = period / NSEC_PER_SEC;
+    schedule.it_interval.tv_nsec = period % NSEC_PER_SEC;
+    schedule.it_value = schedule.it_interval;
+
+    if (timerfd_settime(timer, 0, &schedule, NULL) < 0) {
+        return -1;
+    }
+
+    return add_event_source(loop, timer, EPOLLIN, handler, NULL);
+}
+
+int start_oversampling(struct event_loop * loop)
+{
+    return add_periodic_timer(loop, gOversampleRate, on_sample_timer);
+}
+
+void on_event_poll(struct event_source * source, uint32_t events)
+{
+    uint64_t expirations;
+    bool reconfigured;
+
+    (void)events;
+
+    if (read(source->Fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    if (gBusDown || read_registers(&gEventPlan) < 0 || !check_power_events(&reconfigured)) {
+        return;
+    }
+
+    // Collect and emit at once, along with the configuration when the event
+    // may have changed it.
+
+    if (reconfigured) {
+        gConfigCountdown = 0;
+    }
+
+    run_collection_tick(false);
+}
+
+void on_uevent(struct event_source * source, uint32_t events)
+{
+    char message[4096];
+    ssize_t length;
+    ssize_t offset;
+    bool changed = false;
+
+    (void)events;
+
+    // Uevents are NUL-separated KEY=value lines after an action@devpath
+    // header.
+
+    while ((length = recv(source->Fd, message, sizeof(message) - 1, 0)) > 0) {
+        message[length] = '\0';
+
+        for (offset = 0; offset < length; offset += strlen(message + offset) + 1) {
+            if (strcmp(message + offset, "SUBSYSTEM=power_supply") == 0) {
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        run_collection_tick(false);
+    }
+}
+
+int start_event_polling(struct event_loop * loop)
+{
+    struct sockaddr_nl address;
+    int fd;
+
+    if (gBackend == BackendI2c) {
+        return add_periodic_timer(loop, gEventPollRate, on_event_poll);
+    }
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;  // Kernel uevents
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return add_event_source(loop, fd, EPOLLIN, on_uevent, NULL);
+}
+
+//
+// Replay. With the replay option, the plugin reads no bus at all: the records
+// of a recording are loaded into the shadow one after another and decoded and
+// emitted as fast as possible, with the recorded intervals as the collection
+// times. The throughput is reported on stderr when the recording ends, which
+// makes a recording from the field a benchmark for the decode and output
+// stages.
+//
+
+int replay_recording(void)
+{
+    struct stat status;
+    const uint8_t * recording;
+    const uint8_t * cursor;
+    const uint8_t * end;
+    const uint8_t * payload;
+    struct sample sample;
+    uint64_t timestamp;
+    uint64_t previous;
+    uint64_t started;
+    uint64_t elapsed;
+    uint64_t samples;
+    uint16_t length;
+    bool failed;
+    int fd;
+
+    fd = open(gReplayPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s\n", gReplayPath);
+        return -1;
+    }
+
+    if (fstat(fd, &status) < 0 || (size_t)status.st_size < strlen(RECORD_MAGIC)) {
+        fprintf(stderr, "%s is not a recording\n", gReplayPath);
+        close(fd);
+        return -1;
+    }
+
+    recording = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (recording == MAP_FAILED || memcmp(recording, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0) {
+        fprintf(stderr, "%s is not a recording\n", gReplayPath);
+        return -1;
+    }
+
+    cursor = recording + strlen(RECORD_MAGIC);
+    end = recording + status.st_size;
+    previous = 0;
+    samples = 0;
+    started = clock_ns(CLOCK_MONOTONIC);
+
+    while (end - cursor >= (ptrdiff_t)RECORD_HEADER_SIZE) {
+        memcpy(&timestamp, cursor, sizeof(timestamp));
+        memcpy(&length, cursor + sizeof(timestamp), sizeof(length));
+        cursor += RECORD_HEADER_SIZE;
+
+        failed = (length & RECORD_FAILED) != 0;
+        length &= ~RECORD_FAILED;
+
+        if (end - cursor < length) {
+            break;
+        }
+
+        // Load the ranges into the shadow. Registers a tick did not read keep
+        // the value of the record that last read them, as on the device.
+
+        for (payload = cursor, cursor += length; cursor - payload >= 2 && cursor - payload - 2 >= payload[1]; payload += 2 + payload[1]) {
+            if (payload[0] + payload[1] > (int)sizeof(gShadow)) {
+                break;
+            }
+
+            memcpy(&gShadow[payload[0]], payload + 2, payload[1]);
+        }
+
+        if (payload != cursor) {
+            cursor = payload;
+            break;
+        }
+
+        gIsValid = 0;
+
+        if (!failed) {
+            decode_registers(&gFullPlan);
+        }
+
+        if (gOversampleRate > 0 && !failed) {
+            accumulate_samples();
+            save_aggregates();
+        }
+
+        snapshot_sample(&sample, previous != 0 ? (timestamp - previous) / NSEC_PER_USEC : 0);
+        print_chart_data(&sample);
+
+        previous = timestamp;
+        samples++;
+    }
+
+    elapsed = clock_ns(CLOCK_MONOTONIC) - started;
+    munmap((void *)recording, status.st_size);
+
+    if (cursor != end) {
+        fprintf(stderr, "%s is truncated or corrupt after %" PRIu64 " records\n", gReplayPath, samples);
+        return -1;
+    }
+
+    fprintf(stderr, "Replayed %" PRIu64 " samples in %" PRIu64 " us (%.0f samples/s)\n",
+            samples, (uint64_t)(elapsed / NSEC_PER_USEC), elapsed ? samples * (double)NSEC_PER_SEC / elapsed : 0.0);
+
+    return 0;
+}
+
+//
+// Commands from netdata. Newer netdata versions talk to plugins over stdin
+// using the same line-based protocol as the plugin output. The plugin answers
+// FUNCTION requests (only declared when the functions option is set, since
+// older netdata versions disable plugins that send unknown keywords), and
+// shuts down when netdata closes the pipe.
+//
+// Documentation: https://learn.netdata.cloud/docs/developer-and-contributor-corner/external-plugins#functions
+//   FUNCTION transaction timeout "name [parameters]" ...
+// answered with
+//   FUNCTION_RESULT_BEGIN transaction status content_type expires
+//   (result body)
+//   FUNCTION_RESULT_END
+//
+
+#define MAX_COMMAND_LENGTH 1024
+#define FUNCTION_TIMEOUT 10
+
+struct
+{
+    char Buffer[MAX_COMMAND_LENGTH];
+    size_t Length;
+} gCommands;
+
+bool gFunctionsEnabled;
+
+void print_functions_preamble(void)
+{
+    if (gFunctionsEnabled) {
+        printf("FUNCTION \"chip-registers\" %d \"Dump the AXP209 register shadow\"\n", FUNCTION_TIMEOUT);
+        fflush(stdout);
+    }
+}
+
+void write_function_result(const char * transaction, int status, const char * body, size_t length)
+{
+    static const char end[] = "FUNCTION_RESULT_END\n";
+    char result[MAX_MESSAGE_LENGTH];
+    int headerlength;
+
+    // The result is handed to the emitter thread as a single message.
+
+    headerlength = snprintf(result, sizeof(result), "FUNCTION_RESULT_BEGIN %s %d text/plain %lld\n",
+                            transaction, status, (long long)time(NULL));
+
+    if (headerlength < 0 || (size_t)headerlength + length + sizeof(end) - 1 > sizeof(result)) {
+        fprintf(stderr, "Function result for %s is too long\n", transaction);
+        return;
+    }
+
+    memcpy(result + headerlength, body, length);
+    memcpy(result + headerlength + length, end, sizeof(end) - 1);
+
+    if (queue_message(result, headerlength + length + sizeof(end) - 1) < 0) {
+        fprintf(stderr, "Dropped function result for %s\n", transaction);
+    }
+}
+
+void run_function(const char * transaction, const char * name)
+{
+    char body[256 * 3 + 256 / 16 * 8];
+    char * cursor = body;
+    uint16_t address;
+
+    if (strcmp(name, "chip-registers") != 0) {
+        static const char unknown[] = "Unknown function\n";
+        write_function_result(transaction, 404, unknown, sizeof(unknown) - 1);
+        return;
+    }
+
+    for (address = 0; address < 256; address++) {
+        if (address % 16 == 0) {
+            cursor += sprintf(cursor, "%02x:", address);
+        }
+
+        cursor += sprintf(cursor, " %02x", gShadow[address]);
+
+        if (address % 16 == 15) {
+            *cursor++ = '\n';
+        }
+    }
+
+    write_function_result(transaction, 200, body, cursor - body);
+}
+
+void run_command(char * line)
+{
+    char * saveptr;
+    char * keyword;
+    char * transaction;
+    char * name;
+
+    keyword = strtok_r(line, " ", &saveptr);
+    if (keyword == NULL) {
+        return;
+    }
+
+    if (strcmp(keyword, "FUNCTION") == 0) {
+        transaction = strtok_r(NULL, " ", &saveptr);
+        strtok_r(NULL, " ", &saveptr);
+        name = strtok_r(NULL, "\" ", &saveptr);
+
+        if (transaction != NULL && name != NULL) {
+            run_function(transaction, name);
+        }
+    } else if (strcmp(keyword, "FUNCTION_CANCEL") != 0) {
+        fprintf(stderr, "Ignoring unknown command %s\n", keyword);
+    }
+}
+
+void on_commands(struct event_source * source, uint32_t events)
+{
+    ssize_t count;
+    char * start;
+    char * end;
+
+    (void)events;
+
+    count = read(source->Fd, gCommands.Buffer + gCommands.Length, sizeof(gCommands.Buffer) - gCommands.Length - 1);
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (count <= 0) {
+        // netdata closed the pipe: time to go.
+
+        gEventLoop.Running = false;
+        return;
+    }
+
+    gCommands.Length += count;
+    gCommands.Buffer[gCommands.Length] = '\0';
+
+    // Run every complete line, then keep any partial one for later. A line
+    // that does not fit in the buffer is dropped.
+
+    start = gCommands.Buffer;
+    while ((end = strchr(start, '\n')) != NULL) {
+        *end = '\0';
+        run_command(start);
+        start = end + 1;
+    }
+
+    gCommands.Length -= start - gCommands.Buffer;
+    memmove(gCommands.Buffer, start, gCommands.Length);
+
+    if (gCommands.Length == sizeof(gCommands.Buffer) - 1) {
+        gCommands.Length = 0;
+    }
+}
+
+int listen_for_commands(struct event_loop * loop)
+{
+    // When netdata did not connect stdin (e.g. it is /dev/null, which epoll
+    // refuses), there is simply nothing to listen to.
+
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+
+    if (add_event_source(loop, STDIN_FILENO, EPOLLIN, on_commands, NULL) < 0 && errno != EPERM) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Signals. SIGUSR1 dumps the I2C latency histogram since startup to stderr,
+// which netdata appends to its error log. SIGTERM and SIGINT stop the event
+// loop, so that the plugin shuts down cleanly and flushes its sample log. The
+// signals are blocked and read from a signalfd, so the event loop handles them
+// between ticks like any other input instead of interrupting a transaction.
+//
+
+void dump_latency_histogram(const struct latency_histogram * histogram)
+{
+    uint16_t bucket;
+
+    fprintf(stderr, "I2C transaction latency in ns over %" PRIu32 " transactions: p50 %" PRIu32 ", p90 %" PRIu32
+                    ", p99 %" PRIu32 ", p99.9 %" PRIu32 ", max %" PRIu32 "\n",
+            histogram->Total, latency_percentile(histogram, 500), latency_percentile(histogram, 900),
+            latency_percentile(histogram, 990), latency_percentile(histogram, 999), histogram->Maximum);
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if (histogram->Counts[bucket] != 0) {
+            fprintf(stderr, "  %10" PRIu32 " - %10" PRIu32 ": %" PRIu32 "\n",
+                    bucket > 0 ? latency_bucket_limit(bucket - 1) + 1 : 0, latency_bucket_limit(bucket), histogram->Counts[bucket]);
+        }
+    }
+}
+
+void on_signal(struct event_source * source, uint32_t events)
+{
+    struct signalfd_siginfo info;
+
+    (void)events;
+
+    while (read(source->Fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            dump_latency_histogram(&gLifetimeLatency);
+        } else {
+            gEventLoop.Running = false;
+        }
+    }
+}
+
+void on_emitter_failure(struct event_source * source, uint32_t events)
+{
+    (void)source;
+    (void)events;
+
+    gEventLoop.Running = false;
+}
+
+int listen_for_signals(struct event_loop * loop)
+{
+    sigset_t signals;
+    int fd;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+        return -1;
+    }
+
+    fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    return add_event_source(loop, fd, EPOLLIN, on_signal, NULL);
+}
+
+//
+// Options may be given on the command line, or as "name = value" lines in
+// chip.plugin.conf inside netdata's configuration directory, since netdata
+// itself only passes the update frequency. Command line options win.
+//
+
+#define CONFIG_FILE "chip.plugin.conf"
+
+enum Options
+{
+    OptionCharts = 256,
+    OptionFunctions,
+    OptionOversample,
+    OptionConfigEvery,
+    OptionSimulate,
+    OptionRecord,
+    OptionReplay,
+    OptionBackend,
+    OptionEventPoll,
+    OptionOutputQueue,
+    OptionOutputPolicy,
+    OptionExport,
+    OptionHistory,
+    OptionHistoryLength,
+    OptionLog,
+    OptionLogFlush,
+    OptionStore,
+    OptionStoreFlush,
+};
+
+const struct option gOptions[] = {
+    { "charts",         required_argument, NULL, OptionCharts },
+    { "functions",      optional_argument, NULL, OptionFunctions },
+    { "oversample",     required_argument, NULL, OptionOversample },
+    { "config-every",   required_argument, NULL, OptionConfigEvery },
+    { "simulate",       optional_argument, NULL, OptionSimulate },
+    { "record",         required_argument, NULL, OptionRecord },
+    { "replay",         required_argument, NULL, OptionReplay },
+    { "backend",        required_argument, NULL, OptionBackend },
+    { "event-poll",     required_argument, NULL, OptionEventPoll },
+    { "output-queue",   required_argument, NULL, OptionOutputQueue },
+    { "output-policy",  required_argument, NULL, OptionOutputPolicy },
+    { "export",         required_argument, NULL, OptionExport },
+    { "history",        required_argument, NULL, OptionHistory },
+    { "history-length", required_argument, NULL, OptionHistoryLength },
+    { "log",            required_argument, NULL, OptionLog },
+    { "log-flush",      required_argument, NULL, OptionLogFlush },
+    { "store",          required_argument, NULL, OptionStore },
+    { "store-flush",    required_argument, NULL, OptionStoreFlush },
+    { NULL,             0,                 NULL, 0 }
+};
+
+void print_usage(const char * program)
+{
+    fprintf(stderr, "Usage: %s [--charts=chart[,chart...]] [--functions[=yes|no]] [--oversample=hz]\n"
+                    "          [--config-every=seconds] [--simulate[=faults]]\n"
+                    "          [--record=file | --replay=file] [--backend=auto|i2c|sysfs]\n"
+                    "          [--event-poll=hz] [--output-queue=frames] [--output-policy=newest|all]\n"
+                    "          [--export=file] [--history=file] [--history-length=samples]\n"
+                    "          [--log=file] [--log-flush=seconds] [--store=directory]\n"
+                    "          [--store-flush=seconds] [update_frequency]\n", program);
+}
+
+int parse_number(const char * value, long minimum, long maximum, long * result)
+{
+    char * end;
+
+    errno = 0;
+    *result = strtol(value, &end, 10);
+
+    if (errno != 0 || end == value || *end != '\0' || *result < minimum || *result > maximum) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_bool(const char * value, bool * result)
+{
+    if (value == NULL || strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *result = true;
+    } else if (strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *result = false;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int enable_charts(const char * list)
+{
+    char names[256];
+    char * name;
+    char * saveptr;
+    uint8_t chartindex;
+
+    if (strlen(list) >= sizeof(names)) {
+        return -1;
+    }
+
+    strcpy(names, list);
+    memset(gChartEnabled, 0, sizeof(gChartEnabled));
+
+    // Charts may be named with or without the "Chip." prefix.
+
+    for (name = strtok_r(names, ", ", &saveptr); name != NULL; name = strtok_r(NULL, ", ", &saveptr)) {
+        for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
+            if (strcmp(gChartDefinitions[chartindex].Name, name) == 0 ||
+                strcmp(strchr(gChartDefinitions[chartindex].Name, '.') + 1, name) == 0) {
+                gChartEnabled[chartindex] = true;
+                break;
+            }
+        }
+
+        if (chartindex == NUM_CHARTS) {
+            fprintf(stderr, "Unknown chart %s\n", name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int apply_option(int option, const char * value)
+{
+    long number;
+
+    switch (option)
+    {
+    case OptionCharts:
+        return enable_charts(value);
+    case OptionFunctions:
+        return parse_bool(value, &gFunctionsEnabled);
+    case OptionOversample:
+        if (parse_number(value, 0, MAX_OVERSAMPLE_RATE, &number) < 0) {
+            return -1;
+        }
+
+        gOversampleRate = number;
+        return 0;
+    case OptionConfigEvery:
+        if (parse_number(value, 0, 3600, &number) < 0) {
+            return -1;
+        }
+
+        gConfigEvery = number;
+        return 0;
+    case OptionSimulate:
+        gBus = &gSimulatedBackend;
+        return parse_simulated_faults(value);
+    case OptionRecord:
+        return snprintf(gRecordPath, sizeof(gRecordPath), "%s", value) < (int)sizeof(gRecordPath) ? 0 : -1;
+    case OptionReplay:
+        return snprintf(gReplayPath, sizeof(gReplayPath), "%s", value) < (int)sizeof(gReplayPath) ? 0 : -1;
+    case OptionBackend:
+        if (strcmp(value, "auto") == 0) {
+            gBackend = BackendAuto;
+        } else if (strcmp(value, "i2c") == 0) {
+            gBackend = BackendI2c;
+        } else if (strcmp(value, "sysfs") == 0) {
+            gBackend = BackendSysfs;
+        } else {
+            return -1;
+        }
+
+        return 0;
+    case OptionEventPoll:
+        if (parse_number(value, 0, MAX_EVENT_POLL_RATE, &number) < 0) {
+            return -1;
+        }
+
+        gEventPollRate = number;
+        return 0;
+    case OptionOutputQueue:
+        if (parse_number(value, 1, MAX_PENDING_FRAMES, &number) < 0) {
+            return -1;
+        }
+
+        gPending.Limit = number;
+        return 0;
+    case OptionOutputPolicy:
+        if (strcmp(value, "newest") == 0) {
+            gPending.Policy = KeepNewest;
+        } else if (strcmp(value, "all") == 0) {
+            gPending.Policy = KeepAll;
+        } else {
+            return -1;
+        }
+
+        return 0;
+    case OptionExport:
+        return snprintf(gExportPath, sizeof(gExportPath), "%s", value) < (int)sizeof(gExportPath) ? 0 : -1;
+    case OptionHistory:
+        return snprintf(gHistoryPath, sizeof(gHistoryPath), "%s", value) < (int)sizeof(gHistoryPath) ? 0 : -1;
+    case OptionHistoryLength:
+        if (parse_number(value, 1, MAX_HISTORY_LENGTH, &number) < 0) {
+            return -1;
+        }
+
+        gHistory.Length = number;
+        return 0;
+    case OptionLog:
+        return snprintf(gLog.Path, sizeof(gLog.Path), "%s", value) < (int)sizeof(gLog.Path) ? 0 : -1;
+    case OptionLogFlush:
+        if (parse_number(value, 1, MAX_LOG_FLUSH_INTERVAL, &number) < 0) {
+            return -1;
+        }
+
+        gLog.FlushInterval = number;
+        return 0;
+    case OptionStore:
+        return snprintf(gStore.Directory, sizeof(gStore.Directory), "%s", value) < (int)sizeof(gStore.Directory) ? 0 : -1;
+    case OptionStoreFlush:
+        if (parse_number(value, 1, MAX_STORE_FLUSH_INTERVAL, &number) < 0) {
+            return -1;
+        }
+
+        gStore.FlushInterval = number;
+        return 0;
+    }
+
+    return -1;
+}
+
+char * trim_whitespace(char * text)
+{
+    char * end;
+
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+
+    end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+
+    *end = '\0';
+    return text;
+}
+
+int read_config_file(void)
+{
+    char path[PATH_MAX];
+    char line[512];
+    char * name;
+    char * value;
+    const char * directory;
+    const struct option * option;
+    FILE * file;
+    int err = 0;
+
+    directory = getenv("NETDATA_USER_CONFIG_DIR");
+    if (directory == NULL) {
+        directory = getenv("NETDATA_CONFIG_DIR");
+    }
+
+    if (directory == NULL) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/" CONFIG_FILE, directory);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    while (err == 0 && fgets(line, sizeof(line), file) != NULL) {
+        name = trim_whitespace(line);
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+
+        value = strchr(name, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+            value = trim_whitespace(value);
+            name = trim_whitespace(name);
+        }
+
+        for (option = gOptions; option->name != NULL; option++) {
+            if (strcmp(option->name, name) == 0) {
+                break;
+            }
+        }
+
+        if (option->name == NULL || (option->has_arg == required_argument && value == NULL)) {
+            fprintf(stderr, "Invalid option %s in %s\n", name, path);
+            err = -1;
+        } else {
+            err = apply_option(option->val, value);
+        }
+    }
+
+    fclose(file);
+    return err;
+}
+
+//
+// Queries. "chip.plugin query" answers questions about the history or store
+// series on the device itself, without netdata:
+//   chip.plugin query [--store=directory | --series=file] [--from=time]
+//                     [--to=time] [dimension...]
+// Times are either Unix timestamps in seconds, or durations before now with a
+// s, m, h or d suffix (e.g. --from=90d). With a store, the finest tier that
+// goes back far enough is used. For each dimension, the number of samples,
+// the sum, min, avg & max, and the 50th, 90th & 99th percentiles over the
+// range are printed. Over rollups, the sum and percentiles are those of the
+// per-interval averages, weighted by their number of samples for the sum.
+//
+// The series are mapped read-only, and the ranges scanned with branch-free
+// loops over the contiguous columns that compilers turn into SIMD code at
+// -O3, given -mfpu=neon on the CHIP's Cortex-A8. 16-bit columns are widened
+// a block at a time first, so that the same loops serve both widths.
+//
+// Every stored value lies within its dimension's range, a register field of
+// at most 13 bits scaled into at most some 74,000 distinct values. So the
+// percentiles are exact, and come from counting the values into a histogram
+// of that range in the same pass over each block, and then walking its bins
+// in order, with no copy of the values and no sorting.
+//
+
+#define NUM_QUERY_PERCENTILES 3
+
+const uint32_t gQueryPercentiles[NUM_QUERY_PERCENTILES] = { 50, 90, 99 };
+
+#define QUERY_BLOCK_LENGTH 4096
+
+struct summary
+{
+    uint64_t Count;
+    int64_t Sum;
+    int32_t Minimum;
+    int32_t Maximum;
+};
+
+int32_t gQueryBlocks[NUM_ROLLUP_STATISTICS][QUERY_BLOCK_LENGTH];
+
+// Kernels. Each one makes a single pass for a single result, and neutralizes
+// invalid values arithmetically rather than skipping them with branches,
+// which is what it takes for compilers to vectorize them. SERIES_INVALID is
+// INT32_MIN, which never wins a maximum, and becomes the largest value once
+// biased for the minimum.
+
+int64_t sum_valid(const int32_t * __restrict values, size_t count)
+{
+    int64_t sum = 0;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        sum += values[index] != SERIES_INVALID ? values[index] : 0;
+    }
+
+    return sum;
+}
+
+uint32_t count_valid(const int32_t * __restrict values, size_t count)
+{
+    uint32_t valid = 0;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        valid += values[index] != SERIES_INVALID;
+    }
+
+    return valid;
+}
+
+int64_t sum_weighted(const int32_t * __restrict values, const uint32_t * __restrict weights, size_t count)
+{
+    int64_t sum = 0;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        sum += (int64_t)(values[index] != SERIES_INVALID ? values[index] : 0) * weights[index];
+    }
+
+    return sum;
+}
+
+uint32_t count_weighted(const int32_t * __restrict values, const uint32_t * __restrict weights, size_t count)
+{
+    uint32_t valid = 0;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        valid += weights[index] & -(uint32_t)(values[index] != SERIES_INVALID);
+    }
+
+    return valid;
+}
+
+// Returns INT32_MAX if none of the values is valid.
+
+int32_t min_valid(const int32_t * __restrict values, size_t count)
+{
+    uint32_t minimum = UINT32_MAX;
+    uint32_t biased;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        biased = (uint32_t)values[index] + INT32_MAX;
+        minimum = biased < minimum ? biased : minimum;
+    }
+
+    return minimum != UINT32_MAX ? (int32_t)(minimum - INT32_MAX) : INT32_MAX;
+}
+
+int32_t max_valid(const int32_t * __restrict values, size_t count)
+{
+    int32_t maximum = INT32_MIN;
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        maximum = values[index] > maximum ? values[index] : maximum;
+    }
+
+    return maximum;
+}
+
+void widen_values(const int16_t * __restrict values, size_t count, int32_t * __restrict widened)
+{
+    size_t index;
+
+    for (index = 0; index < count; index++) {
+        widened[index] = values[index] != SERIES_INVALID16 ? values[index] : SERIES_INVALID;
+    }
+}
+
+// Counts the values into a histogram of the span values from low on. Invalid
+// values, which wrap around to far past the span, and any others outside it,
+// which only a damaged file holds, go to the extra bin at the end.
+
+void count_values(const int32_t * __restrict values, size_t count, int32_t low, uint32_t span, uint32_t * __restrict histogram)
+{
+    size_t index;
+    uint32_t bin;
+
+    for (index = 0; index < count; index++) {
+        bin = (uint32_t)values[index] - (uint32_t)low;
+        histogram[bin < span ? bin : span]++;
+    }
+}
+
+// Returns a run of a column as 32-bit values, widened into the statistic's
+// query block if the column holds 16-bit ones.
+
+const int32_t * load_values(const struct series * series, uint32_t dimension, enum Statistics statistic, size_t start, size_t count)
+{
+    if (series->Header->Widths[dimension] == sizeof(int32_t)) {
+        return (const int32_t *)series_column(series, dimension, statistic) + start;
+    }
+
+    widen_values((const int16_t *)series_column(series, dimension, statistic) + start, count, gQueryBlocks[statistic]);
+    return gQueryBlocks[statistic];
+}
+
+// Adds a contiguous run of slots to the summary, and counts its values into
+// the histogram, a block at a time so that the passes over a block find it in
+// the cache.
+
+void summarize_run(const struct series * series, uint32_t dimension, size_t start, size_t count, struct summary * summary,
+                   int32_t low, uint32_t span, uint32_t * histogram)
+{
+    const int32_t * values;
+    const int32_t * minimums;
+    const int32_t * maximums;
+    size_t offset;
+    size_t length;
+    int32_t minimum;
+    int32_t maximum;
+
+    for (offset = 0; offset < count; offset += length) {
+        length = count - offset < QUERY_BLOCK_LENGTH ? count - offset : QUERY_BLOCK_LENGTH;
+
+        if (series->NumStatistics == 1) {
+            values = minimums = maximums = load_values(series, dimension, 0, start + offset, length);
+
+            summary->Sum += sum_valid(values, length);
+            summary->Count += count_valid(values, length);
+        } else {
+            values = load_values(series, dimension, StatisticAvg, start + offset, length);
+            minimums = load_values(series, dimension, StatisticMin, start + offset, length);
+            maximums = load_values(series, dimension, StatisticMax, start + offset, length);
+
+            summary->Sum += sum_weighted(values, series->Samples + start + offset, length);
+            summary->Count += count_weighted(values, series->Samples + start + offset, length);
+        }
+
+        minimum = min_valid(minimums, length);
+        maximum = max_valid(maximums, length);
+
+        summary->Minimum = minimum < summary->Minimum ? minimum : summary->Minimum;
+        summary->Maximum = maximum > summary->Maximum ? maximum : summary->Maximum;
+
+        count_values(values, length, low, span, histogram);
+    }
+}
+
+int map_series(struct series * series, const char * path)
+{
+    struct series_header * header;
+    struct stat status;
+    uint32_t index;
+    bool unknownwidth = false;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &status) < 0 || (size_t)status.st_size < sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+
+    header = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        return -1;
+    }
+
+    for (index = 0; index < NUM_STORED_DIMENSIONS; index++) {
+        unknownwidth |= header->Widths[index] != sizeof(int16_t) && header->Widths[index] != sizeof(int32_t);
+    }
+
+    if (memcmp(header->Magic, SERIES_MAGIC, sizeof(header->Magic)) != 0 ||
+        header->NumDimensions != NUM_STORED_DIMENSIONS || header->Capacity == 0 || unknownwidth ||
+        (header->NumStatistics != 1 && header->NumStatistics != NUM_ROLLUP_STATISTICS) ||
+        (size_t)status.st_size < get_series_size(header)) {
+        fprintf(stderr, "%s is not a series written by this version of the plugin\n", path);
+        munmap(header, status.st_size);
+        return -1;
+    }
+
+    series->Name = path;
+    series->Length = header->Capacity;
+    series->Resolution = header->Resolution;
+    series->NumStatistics = header->NumStatistics;
+    series->Header = header;
+    series->Size = status.st_size;
+    series->Fd = -1;
+
+    lay_out_series(series);
+    return 0;
+}
+
+// Returns the number of the first slot from first to written whose timestamp
+// is at or after the given one.
+
+uint64_t find_series_slot(const struct series * series, uint64_t first, uint64_t written, uint64_t timestamp)
+{
+    uint64_t middle;
+
+    while (first < written) {
+        middle = first + (written - first) / 2;
+
+        if (series->Header->Timestamps[middle % series->Header->Capacity] < timestamp) {
+            first = middle + 1;
+        } else {
+            written = middle;
+        }
+    }
+
+    return first;
+}
+
+int parse_query_time(const char * value, uint64_t now, uint64_t * result)
+{
+    static const struct { char Suffix; uint32_t Seconds; } units[] = {
+        { 's', 1 }, { 'm', 60 }, { 'h', 3600 }, { 'd', 86400 },
+    };
+    char * end;
+    unsigned long long number;
+    uint8_t index;
+
+    errno = 0;
+    number = strtoull(value, &end, 10);
+    if (errno != 0 || end == value) {
+        return -1;
+    }
+
+    if (*end == '\0') {
+        *result = number * NSEC_PER_SEC;
+        return 0;
+    }
+
+    for (index = 0; index < sizeof(units) / sizeof(units[0]); index++) {
+        if (end[0] == units[index].Suffix && end[1] == '\0') {
+            number *= units[index].Seconds;
+            *result = number * NSEC_PER_SEC < now ? now - number * NSEC_PER_SEC : 0;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int find_series_dimension(const struct series * series, const char * name)
+{
+    uint32_t index;
+
+    for (index = 0; index < series->Header->NumDimensions; index++) {
+        if (strncmp(series->Header->Dimensions[index].Name, name, sizeof(series->Header->Dimensions[index].Name)) == 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+void print_query_value(int64_t value, int32_t divisor)
+{
+    int decimals = 0;
+    int32_t scale;
+
+    for (scale = 1; scale < divisor; scale *= 10) {
+        decimals++;
+    }
+
+    printf(" %12.*f", decimals, (double)value / divisor);
+}
+
+// Prints the percentiles of the values counted in the histogram, each the
+// value of the same rank among them as if they were sorted. The bins are
+// walked once, since the percentiles come in increasing order.
+
+void print_percentiles(const uint32_t * histogram, int32_t low, uint32_t span, int32_t divisor)
+{
+    uint64_t total = 0;
+    uint64_t counted = 0;
+    uint64_t rank;
+    uint32_t bin;
+    uint8_t index;
+
+    for (bin = 0; bin < span; bin++) {
+        total += histogram[bin];
+    }
+
+    if (total == 0) {
+        return;
+    }
+
+    for (index = 0, bin = 0; index < NUM_QUERY_PERCENTILES; index++) {
+        rank = (total - 1) * gQueryPercentiles[index] / 100;
+
+        while (counted + histogram[bin] <= rank) {
+            counted += histogram[bin++];
+        }
+
+        print_query_value((int64_t)low + bin, divisor);
+    }
+}
+
+// Returns the number of bins a histogram needs for the dimension's values,
+// plus the extra one, and the lowest value.
+
+uint32_t get_histogram_size(uint32_t dimension, int32_t * low)
+{
+    int64_t first;
+    int64_t last;
+
+    get_dimension_range(dimension, &first, &last);
+
+    *low = first;
+    return last - first + 2;
+}
+
+// Summarizes one dimension over the slots first to last, which is at most two
+// contiguous runs of the ring, and prints it unless it has no samples and was
+// not asked for by name. Returns -1 if the slots were overwritten while being
+// read.
+
+int summarize_dimension(const struct series * series, uint32_t dimension, uint64_t first, uint64_t last,
+                        bool named, uint32_t * histogram)
+{
+    const struct series_header * header = series->Header;
+    struct summary summary = { 0, 0, INT32_MAX, INT32_MIN };
+    uint32_t bins;
+    int32_t low;
+    uint64_t slot;
+    size_t start;
+    size_t count;
+
+    bins = get_histogram_size(dimension, &low);
+    memset(histogram, 0, bins * sizeof(uint32_t));
+
+    for (slot = first; slot < last; slot += count) {
+        start = slot % header->Capacity;
+        count = header->Capacity - start < last - slot ? header->Capacity - start : last - slot;
+
+        summarize_run(series, dimension, start, count, &summary, low, bins - 1, histogram);
+    }
+
+    if (oldest_series_slot(series, atomic_load_explicit(&series->Header->Written, memory_order_acquire)) > first) {
+        return -1;
+    }
+
+    if (summary.Count == 0 && !named) {
+        return 0;
+    }
+
+    printf("%-24.24s %12" PRIu64, header->Dimensions[dimension].Name, summary.Count);
+
+    if (summary.Count == 0) {
+        printf("\n");
+        return 0;
+    }
+
+    print_query_value(summary.Sum, header->Dimensions[dimension].Divisor);
+    print_query_value(summary.Minimum, header->Dimensions[dimension].Divisor);
+    print_query_value(summary.Sum / (int64_t)summary.Count, header->Dimensions[dimension].Divisor);
+    print_query_value(summary.Maximum, header->Dimensions[dimension].Divisor);
+    print_percentiles(histogram, low, bins - 1, header->Dimensions[dimension].Divisor);
+
+    printf("\n");
+    return 0;
+}
+
+void query_dimension(const struct series * series, uint32_t dimension, uint64_t from, uint64_t to,
+                     bool named, uint32_t * histogram)
 {
-    internaltemp,
-    batlevel,
-    chargelimit,
-    chargeterm,
-    batcharge,
-    batdischarge,
-    batvoltage,
-    acinvoltage,
-    acincurrent,
-    vbusvoltage,
-    vbusvoltagelimit,
-    vbuscurrent,
-    vbuscurrentlimit,
+    uint64_t written;
+    uint64_t first;
+    uint64_t last;
+    uint8_t attempts;
 
-    MaxDimensions
-};
+    // Start over if the plugin overwrote the start of the range meanwhile.
+
+    for (attempts = 0; attempts < 3; attempts++) {
+        written = atomic_load_explicit(&series->Header->Written, memory_order_acquire);
+        first = find_series_slot(series, oldest_series_slot(series, written), written, from);
+        last = find_series_slot(series, first, written, to + 1);
+
+        if (summarize_dimension(series, dimension, first, last, named, histogram) == 0) {
+            return;
+        }
+    }
+}
 
-enum DataType
+enum QueryOptions
 {
-    Float,
-    Uint8,
-    Uint16
+    QueryOptionStore = 256,
+    QueryOptionSeries,
+    QueryOptionFrom,
+    QueryOptionTo,
 };
 
-struct
+const struct option gQueryOptions[] = {
+    { "store",  required_argument, NULL, QueryOptionStore },
+    { "series", required_argument, NULL, QueryOptionSeries },
+    { "from",   required_argument, NULL, QueryOptionFrom },
+    { "to",     required_argument, NULL, QueryOptionTo },
+    { NULL,     0,                 NULL, 0 }
+};
+
+void print_query_usage(const char * program)
 {
-    char * Name;
-    enum DataType DataType;
-    char * DataFormat;
-    char * Properties;
-} const gDimensionDefinitions[MaxDimensions] = {
-    { "internaltemp",     Float,  "%.1f",     "\"Internal Temp\" absolute" },
-    { "batlevel",         Uint8,  "%" PRIu8,  "\"Charge\" absolute" },
-    { "chargelimit",      Uint16, "%" PRIu16, "\"Charge Limit\" absolute" },
-    { "chargeterm",       Uint16, "%" PRIu16, "\"Charge Termination Limit\" absolute" },
-    { "batcharge",        Float,  "%.1f",     "\"Batt Charge\" absolute" },
-    { "batdischarge",     Uint16, "%" PRIu16, "\"Batt Discharge\" absolute" },
-    { "batvoltage",       Float,  "%.1f",     "\"Voltage\" absolute" },
-    { "acinvoltage",      Float,  "%.1f",     "\"Voltage\" absolute" },
-    { "acincurrent",      Float,  "%.3f",     "\"Current\" absolute" },
-    { "vbusvoltage",      Float,  "%.1f",     "\"Voltage\" absolute" },
-    { "vbusvoltagelimit", Uint16, "%" PRIu16, "\"Limit\" absolute" },
-    { "vbuscurrent",      Float,  "%.3f",     "\"Current\" absolute" },
-    { "vbuscurrentlimit", Uint16, "%" PRIu16, "\"Limit\" absolute" },
-};
-
-#define MAX_CHART_DIMENSIONS 4
-#define EMPTY_DIM MaxDimensions
+    fprintf(stderr, "Usage: %s query [--store=directory | --series=file] [--from=time] [--to=time]\n"
+                    "          [dimension...]\n"
+                    "Times are Unix timestamps in seconds, or durations before now such as 30m or 90d.\n", program);
+}
 
-struct
+int run_query(int argc, char ** argv)
 {
-    char * Name;
-    char * Properties;
-    enum Dimensions Dimensions[MAX_CHART_DIMENSIONS];
-} const gChartDefinitions[] = {
-    { "Chip.temps", "\"\" \"Temperature\" \"Degrees (F)\"", { internaltemp, EMPTY_DIM, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.batterylevel", "\"\" \"Battery Level\" \"%\"", { batlevel, EMPTY_DIM, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.batterycurrent", "\"\" \"Battery Current\" \"mA\"", { chargelimit, chargeterm, batcharge, batdischarge } },
-    { "Chip.batteryvoltage", "\"\" \"Battery Voltage\" \"mV\"", { batvoltage, EMPTY_DIM, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.acinvoltage", "\"\" \"ACIN Voltage\" \"mV\"", { acinvoltage, EMPTY_DIM, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.acincurrent", "\"\" \"ACIN Current\" \"mA\"", { acincurrent, EMPTY_DIM, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.vbusvoltage", "\"\" \"VBUS Voltage\" \"mV\"", { vbusvoltage, vbusvoltagelimit, EMPTY_DIM, EMPTY_DIM } },
-    { "Chip.vbuscurrent", "\"\" \"VBUS Current\" \"mA\"", { vbuscurrent, vbuscurrentlimit, EMPTY_DIM, EMPTY_DIM } },
-};
+    struct series series;
+    struct series tiers[NUM_STORE_TIERS];
+    char paths[NUM_STORE_TIERS][PATH_MAX];
+    char seriespath[PATH_MAX] = "";
+    uint64_t now = clock_ns(CLOCK_REALTIME);
+    uint64_t from = 0;
+    uint64_t to = now;
+    uint64_t written;
+    uint32_t * histogram;
+    uint32_t bins = 0;
+    int32_t low;
+    int dimension;
+    int option;
+    int tier;
+    int index;
 
-#define NUM_CHARTS (sizeof(gChartDefinitions) / sizeof(gChartDefinitions[0]))
+    // Pick up the store directory from the plugin's configuration, which is
+    // in netdata's when run by hand.
 
-//
-// C.H.I.P. hardware-specific constants.
-//
+    setenv("NETDATA_CONFIG_DIR", "/etc/netdata", 0);
+    if (read_config_file() < 0) {
+        return 1;
+    }
 
-#define I2C_DEVICE "i2c-0"
-#define AXP209_ADDRESS 0x34
+    // Skip over "query".
 
-int gI2c;
-uint16_t gUpdateEvery;
+    optind = 2;
+
+    while ((option = getopt_long(argc, argv, "", gQueryOptions, NULL)) != -1) {
+        switch (option)
+        {
+        case QueryOptionStore:
+            snprintf(gStore.Directory, sizeof(gStore.Directory), "%s", optarg);
+            break;
+        case QueryOptionSeries:
+            snprintf(seriespath, sizeof(seriespath), "%s", optarg);
+            break;
+        case QueryOptionFrom:
+        case QueryOptionTo:
+            if (parse_query_time(optarg, now, option == QueryOptionFrom ? &from : &to) == 0) {
+                break;
+            }
+            /* fall through */
+        default:
+            print_query_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (seriespath[0] != '\0') {
+        if (map_series(&series, seriespath) < 0) {
+            fprintf(stderr, "Unable to read %s\n", seriespath);
+            return 1;
+        }
+    } else if (gStore.Directory[0] != '\0') {
+
+        // Use the finest tier that has not lost anything since the start of
+        // the range, or else the one that goes back furthest.
+
+        for (tier = 0; tier < (int)NUM_STORE_TIERS; tier++) {
+            if (snprintf(paths[tier], sizeof(paths[tier]), "%s/%s", gStore.Directory, gStore.Tiers[tier].Name) >= (int)sizeof(paths[tier]) ||
+                map_series(&tiers[tier], paths[tier]) < 0) {
+                fprintf(stderr, "Unable to read %s\n", paths[tier]);
+                return 1;
+            }
+        }
+
+        for (tier = 0; tier < (int)NUM_STORE_TIERS - 1; tier++) {
+            written = atomic_load_explicit(&tiers[tier].Header->Written, memory_order_acquire);
+            if (written <= tiers[tier].Header->Capacity ||
+                tiers[tier].Header->Timestamps[oldest_series_slot(&tiers[tier], written) % tiers[tier].Header->Capacity] <= from) {
+                break;
+            }
+        }
+
+        series = tiers[tier];
+    } else {
+        print_query_usage(argv[0]);
+        return 1;
+    }
+
+    // One histogram serves every dimension in turn.
+
+    for (dimension = 0; dimension < NUM_STORED_DIMENSIONS; dimension++) {
+        if (get_histogram_size(dimension, &low) > bins) {
+            bins = get_histogram_size(dimension, &low);
+        }
+    }
+
+    histogram = malloc(bins * sizeof(uint32_t));
+    if (histogram == NULL) {
+        fprintf(stderr, "Not enough memory for the query\n");
+        return 1;
+    }
+
+    // Rollups cover the whole interval they start.
+
+    if (series.Resolution != 0) {
+        from -= from % (series.Resolution * NSEC_PER_SEC);
+    }
+
+    for (index = optind; index < argc; index++) {
+        if (find_series_dimension(&series, argv[index]) < 0) {
+            fprintf(stderr, "Unknown dimension %s\n", argv[index]);
+            free(histogram);
+            return 1;
+        }
+    }
+
+    printf("# %s, %s\n", series.Name, series.Resolution == 0 ? "samples" : series.Resolution == 60 ? "per minute" : "per hour");
+    printf("%-24s %12s %12s %12s %12s %12s %12s %12s %12s\n", "dimension", "samples", "sum", "min", "avg", "max", "p50", "p90", "p99");
+
+    if (optind == argc) {
+        for (dimension = 0; dimension < (int)series.Header->NumDimensions; dimension++) {
+            query_dimension(&series, dimension, from, to, false, histogram);
+        }
+    }
+
+    for (index = optind; index < argc; index++) {
+        query_dimension(&series, find_series_dimension(&series, argv[index]), from, to, true, histogram);
+    }
+
+    free(histogram);
+    return 0;
+}
+
+#ifdef CHIP_BENCHMARK
 
 //
-// After it is read from the I2C bus and processed, the data for each dimension
-// is stored in the gData array and a bit is set in the gIsValid bitmask to\
-// indicate that the data can be used.
+// Benchmarks. Building with -DCHIP_BENCHMARK turns the plugin into a
+// benchmark of its own collection stages:
+//   gcc -O2 -pthread -DCHIP_BENCHMARK -o chip.bench chip.plugin.c
+//   ./chip.bench [iterations]
+// Each stage runs in isolation against the simulated AXP209 with all charts
+// enabled, and the whole tick runs as the scheduler would run it. Chart
+// output goes to /dev/null, and the results are printed to stdout as one JSON
+// object per line, preceded by one describing the machine:
+//   ns_per_op             wall clock time
+//   instructions_per_op   user space instructions, or null when perf events
+//                         are unavailable
+//   allocations_per_op    heap allocations, or null on other C libraries
+//                         than glibc
+//   syscalls_per_op       read and write syscalls, from /proc/self/io
+//   bus_transactions_per_op
+//                         transactions with the (simulated) AXP209, each of
+//                         which is one syscall on the i2c-dev bus
 //
 
-typedef union {
-    float asFloat;
-    uint8_t asUint8;
-    uint16_t asUint16;
-} value_t;
+#define DEFAULT_BENCHMARK_ITERATIONS 1000000
+
+#ifdef __GLIBC__
 
-value_t gData[MaxDimensions];
-uint32_t gIsValid;
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * pointer, size_t size);
+extern void __libc_free(void * pointer);
 
-void save_data_float(enum Dimensions index, float value)
+uint64_t gAllocations;
+
+void * malloc(size_t size)
 {
-    gData[index].asFloat = value;
-    gIsValid |= 1 << index;
+    gAllocations++;
+    return __libc_malloc(size);
 }
 
-void save_data_uint8(enum Dimensions index, uint8_t value)
+void * calloc(size_t count, size_t size)
 {
-    gData[index].asUint8 = value;
-    gIsValid |= 1 << index;
+    gAllocations++;
+    return __libc_calloc(count, size);
 }
 
-void save_data_uint16(enum Dimensions index, uint16_t value)
+void * realloc(void * pointer, size_t size)
 {
-    gData[index].asUint16 = value;
-    gIsValid |= 1 << index;
+    gAllocations++;
+    return __libc_realloc(pointer, size);
 }
 
-void format_data_value(enum Dimensions index, char buffer[32])
+void free(void * pointer)
 {
-    if ((gIsValid & (1 << index)) == 0) {
-        buffer[0] = '\0';
-        return;
-    }
-
-    switch (gDimensionDefinitions[index].DataType)
-    {
-    case Float:
-        sprintf(buffer, gDimensionDefinitions[index].DataFormat, gData[index].asFloat);
-        break;
-    case Uint8:
-        sprintf(buffer, gDimensionDefinitions[index].DataFormat, gData[index].asUint8);
-        break;
-    case Uint16:
-        sprintf(buffer, gDimensionDefinitions[index].DataFormat, gData[index].asUint16);
-        break;
-    }
+    __libc_free(pointer);
 }
 
+#define COUNTS_ALLOCATIONS true
 
-int read_register_value(uint8_t address)
+#else
+
+uint64_t gAllocations;
+
+#define COUNTS_ALLOCATIONS false
+
+#endif
+
+struct benchmark
 {
-    int err;
-    uint8_t buffer[1] = { address };
+    const char * Name;
+    void (*Run)(uint64_t iterations);
+    uint32_t Scale;     // Divides the iterations for the slower stages
+};
 
-    err = write(gI2c, buffer, sizeof(buffer));
-    if (err < 0) {
-        fprintf(stderr, "Unable to query for register %#02x\n", address);
-        exit(1);
-    }
+char gBenchmarkScratch[MAX_FRAGMENT_LENGTH];
+struct sample gBenchmarkSample;
 
-    err = read(gI2c, buffer, sizeof(buffer));
-    if (err < 0) {
-        fprintf(stderr, "Unable to read register %#02x\n", address);
-        exit(1);
+void benchmark_format_data_value(uint64_t iterations)
+{
+    uint64_t iteration;
+
+    snapshot_sample(&gBenchmarkSample, 1000000);
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        format_data_value(&gBenchmarkSample, iteration % NUM_SENSOR_DIMENSIONS, gBenchmarkScratch);
     }
+}
 
-    return buffer[0];
+void benchmark_read_registers(uint64_t iterations)
+{
+    uint64_t iteration;
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        read_registers(&gFullPlan);
+    }
 }
 
-void write_register_value(uint8_t address, uint8_t value)
+void benchmark_decode_registers(uint64_t iterations)
 {
-    int err;
-    uint8_t buffer[2] = { address, value };
+    uint64_t iteration;
 
-    err = write(gI2c, buffer, sizeof(buffer));
-    if (err < 0) {
-        fprintf(stderr, "Unable to write register %#02x\n", address);
-        exit(1);
+    for (iteration = 0; iteration < iterations; iteration++) {
+        decode_registers(&gFullPlan);
     }
 }
 
-int enable_adc(void)
+void benchmark_gather_chart_data(uint64_t iterations)
 {
-    int err;
-    uint8_t value;
-    bool wait;
+    uint64_t iteration;
 
-    err = ioctl(gI2c, I2C_SLAVE_FORCE, AXP209_ADDRESS);
-    if (err < 0) {
-        return err;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        gather_chart_data(true);
     }
+}
 
-    // Ensure both ADC enable registers have sufficient bitmasks to enable the
-    // features necessary for querying power.
+void benchmark_print_chart_data(uint64_t iterations)
+{
+    uint64_t iteration;
 
-    wait = false;
+    snapshot_sample(&gBenchmarkSample, 1000000);
 
-    value = read_register_value(0x82);
-    if ((value & 0xCC) != 0xCC) {
-        write_register_value(0x82, value | 0xCC);
-        wait = true;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        print_chart_data(&gBenchmarkSample);
     }
+}
 
-    value = read_register_value(0x83);
-    if ((value & 0x80) != 0x80) {
-        write_register_value(0x83, value | 0x80);
-        wait = true;
+void benchmark_print_charts_preamble(uint64_t iterations)
+{
+    uint64_t iteration;
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        print_charts_preamble();
     }
+}
 
-    // Wait for 1/25 seconds to ensure the ADC takes a reading.
+void benchmark_collection_tick(uint64_t iterations)
+{
+    uint64_t iteration;
 
-    if (wait) {
-        usleep(40000);
-    }
+    // Without an emitter thread, the queued frame is written out inline.
 
-    return 0;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        run_collection_tick(true);
+        emit_queued_output();
+    }
 }
 
-uint16_t read_multi_value(uint8_t highaddress, uint8_t lowaddress)
+const struct benchmark gBenchmarks[] = {
+    { "format_data_value",     benchmark_format_data_value,     1 },
+    { "read_registers",        benchmark_read_registers,        1 },
+    { "decode_registers",      benchmark_decode_registers,      1 },
+    { "gather_chart_data",     benchmark_gather_chart_data,     1 },
+    { "print_chart_data",      benchmark_print_chart_data,      1 },
+    { "print_charts_preamble", benchmark_print_charts_preamble, 100 },
+    { "collection_tick",       benchmark_collection_tick,       1 },
+};
+
+int open_instruction_counter(void)
 {
-    uint16_t highvalue = read_register_value(highaddress);
-    uint16_t lowvalue = read_register_value(lowaddress);
+    struct perf_event_attr attributes;
 
-    return (highvalue << 4) | (lowvalue & 0xF);
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
 }
 
-void gather_chart_data(void)
+uint64_t count_syscalls(void)
 {
-    uint8_t charge_ctl;
-    uint8_t power_status;
+    char buffer[512];
+    char * field;
+    uint64_t count = 0;
+    ssize_t length;
+    int fd;
 
-    memset(gData, 0, sizeof(gData));
-    gIsValid = 0;
+    fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
 
-    power_status = read_register_value(0x01);
-    charge_ctl = read_register_value(0x33);
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
 
-    float temp = read_multi_value(0x5E, 0x5F) * 0.18 - 228.46;
-    save_data_float(internaltemp, temp);
+    if (length <= 0) {
+        return 0;
+    }
 
-    if (charge_ctl & 0x80) {
-        uint16_t charge_current_limit = (uint16_t)(charge_ctl & 0xf) * 100 + 300;
-        save_data_uint16(chargelimit, charge_current_limit);
+    buffer[length] = '\0';
 
-        uint16_t charge_termination_limit = charge_current_limit / 10;
-        if (charge_ctl & 0x10) {
-            charge_termination_limit += charge_termination_limit >> 1;
-        }
+    if ((field = strstr(buffer, "syscr:")) != NULL) {
+        count += strtoull(field + 6, NULL, 10);
+    }
 
-        save_data_uint16(chargeterm, charge_termination_limit);
+    if ((field = strstr(buffer, "syscw:")) != NULL) {
+        count += strtoull(field + 6, NULL, 10);
     }
 
-    if (power_status & 0x20) {
-        float bat_charge = read_multi_value(0x7A, 0x7B) / 2.0f;
-        save_data_float(batcharge, bat_charge);
+    return count;
+}
 
-        uint16_t bat_discharge = (read_register_value(0x7C) << 5) | (read_register_value(0x7D) & 0x1F);
-        save_data_uint16(batdischarge, bat_discharge);
+void run_benchmark(const struct benchmark * benchmark, uint64_t iterations, int counter, uint64_t syscallbias, FILE * results)
+{
+    uint64_t started;
+    uint64_t elapsed;
+    uint64_t instructions = 0;
+    uint64_t allocations;
+    uint64_t syscalls;
+    uint32_t transactions;
 
-        uint8_t bat_gauge = read_register_value(0xB9) & 0x7F;
-        save_data_uint8(batlevel, bat_gauge);
+    iterations = iterations / benchmark->Scale > 0 ? iterations / benchmark->Scale : 1;
 
-        float bat_voltage = read_multi_value(0x78, 0x79) * 1.1f;
-        save_data_float(batvoltage, bat_voltage);
-    }
+    // Warm up the caches and branch predictors first.
 
-    if (power_status & 0x80) {
-        float acin_voltage = read_multi_value(0x56, 0x57) * 1.7f;
-        save_data_float(acinvoltage, acin_voltage);
+    benchmark->Run(iterations / 100 + 1);
 
-        float acin_current = read_multi_value(0x58, 0x59) * .625f;
-        save_data_float(acincurrent, acin_current);
+    syscalls = count_syscalls();
+    transactions = gSimulator.Step;
+    allocations = gAllocations;
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
     }
 
-    if (power_status & 0x20) {
-        float vbus_voltage = read_multi_value(0x5A, 0x5B) * 1.7f;
-        save_data_float(vbusvoltage, vbus_voltage);
+    started = clock_ns(CLOCK_MONOTONIC);
+    benchmark->Run(iterations);
+    elapsed = clock_ns(CLOCK_MONOTONIC) - started;
 
-        float vbus_current = read_multi_value(0x5C, 0x5D) * .375f;
-        save_data_float(vbuscurrent, vbus_current);
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &instructions, sizeof(instructions)) != sizeof(instructions)) {
+            counter = -1;
+        }
     }
 
-    uint8_t vbus_ipsout = read_register_value(0x30);
-    if (vbus_ipsout & 0x40) {
-        uint16_t vbus_voltage_limit = (vbus_ipsout >> 3) * 100 + 4000;
-        save_data_float(vbusvoltagelimit, vbus_voltage_limit);
+    allocations = gAllocations - allocations;
+    transactions = gSimulator.Step - transactions;
+    syscalls = count_syscalls() - syscalls - syscallbias;
+
+    fprintf(results, "{\"benchmark\":\"%s\",\"iterations\":%" PRIu64 ",\"ns_per_op\":%.2f,",
+            benchmark->Name, iterations, (double)elapsed / iterations);
+
+    if (counter >= 0) {
+        fprintf(results, "\"instructions_per_op\":%.1f,", (double)instructions / iterations);
+    } else {
+        fprintf(results, "\"instructions_per_op\":null,");
     }
 
-    if ((vbus_ipsout & 0x3) < 3) {
-        static const uint16_t targets[] = { 900, 500, 100 };
-        uint16_t vbus_current_limit = targets[vbus_ipsout & 0x3];
-        save_data_uint16(vbuscurrentlimit, vbus_current_limit);
+    if (COUNTS_ALLOCATIONS) {
+        fprintf(results, "\"allocations_per_op\":%.3f,", (double)allocations / iterations);
+    } else {
+        fprintf(results, "\"allocations_per_op\":null,");
     }
+
+    fprintf(results, "\"syscalls_per_op\":%.3f,\"bus_transactions_per_op\":%.3f}\n",
+            (double)syscalls / iterations, (double)transactions / iterations);
+    fflush(results);
 }
 
-void print_charts_preamble()
+int run_benchmarks(int argc, char** argv)
 {
-    // Documentation: https://github.com/firehol/netdata/wiki/External-Plugins#chart
-    // The format for each chart is:
-    //   CHART type.id name title units [family [context [charttype (line, area, stacked)]]]]
-    //   DIMENSION id [name [algorithm [multiplier [divisor [hidden]]]]]
-    //   (repeat dimensions as necessary)
+    struct utsname system;
+    uint64_t iterations = DEFAULT_BENCHMARK_ITERATIONS;
+    uint64_t syscallbias;
+    uint8_t index;
+    FILE * results;
+    int counter;
+    int null;
 
-    uint8_t chartindex;
-    uint8_t dimindex;
-    enum Dimensions targetindex;
+    if (argc > 1) {
+        iterations = strtoull(argv[1], NULL, 10);
+        if (iterations == 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
 
-    for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
-        printf("CHART %s %s\n",
-               gChartDefinitions[chartindex].Name,
-               gChartDefinitions[chartindex].Properties);
+    // Keep stdout for the results and send the chart output to /dev/null.
 
-        for (dimindex = 0; dimindex < MAX_CHART_DIMENSIONS; dimindex++) {
-            targetindex = gChartDefinitions[chartindex].Dimensions[dimindex];
-            if (targetindex != EMPTY_DIM) {
-                printf("DIMENSION %s %s\n",
-                       gDimensionDefinitions[targetindex].Name,
-                       gDimensionDefinitions[targetindex].Properties);
-            }
-        }
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    null = open("/dev/null", O_WRONLY);
+    if (results == NULL || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Unable to redirect the chart output\n");
+        return 1;
     }
 
-    fflush(stdout);
-}
+    close(null);
 
-void print_chart_data(uint64_t delayus)
-{
-    // Documentation: https://github.com/firehol/netdata/wiki/External-Plugins#data-collection
-    // The format for each chart is:
-    //   BEGIN type.id [microseconds]
-    //   SET id = value
-    //   (repeat as necessary)
-    //   END
-    
-    char buffer[32];
-    uint8_t chartindex;
-    uint8_t dimindex;
-    enum Dimensions targetindex;
+    // Collect as the plugin would by default, from the simulated AXP209.
 
-    for (chartindex = 0; chartindex < NUM_CHARTS; chartindex++) {
+    memset(gChartEnabled, true, sizeof(gChartEnabled));
+    gUpdateEvery = 1;
+    gBus = &gSimulatedBackend;
 
-        // Chart prologue
+    if (gBus->Open() < 0 || enable_adc() < 0) {
+        fprintf(stderr, "Unable to set up the simulated AXP209\n");
+        return 1;
+    }
 
-        printf("BEGIN %s", gChartDefinitions[chartindex].Name);
-        if (delayus) {
-            printf(" %" PRIu64 "\n", delayus);
-        } else {
-            printf("\n");
-        }
+    plan_reads();
 
-        // Dimension data
+    if (prepare_output() < 0) {
+        return 1;
+    }
 
-        for (dimindex = 0; dimindex < MAX_CHART_DIMENSIONS; dimindex++) {
-            targetindex = gChartDefinitions[chartindex].Dimensions[dimindex];
-            if (targetindex != EMPTY_DIM) {
-                format_data_value(targetindex, buffer);
-                printf("SET %s = %s\n", gDimensionDefinitions[targetindex].Name, buffer);
-            }
-        }
+    gather_chart_data(true);
 
-        // Chart epilogue
+    counter = open_instruction_counter();
 
-        printf("END\n");
+    // Reading /proc/self/io costs syscalls of its own.
+
+    syscallbias = count_syscalls();
+    syscallbias = count_syscalls() - syscallbias;
+
+    uname(&system);
+    fprintf(results, "{\"machine\":\"%s\",\"release\":\"%s\",\"compiler\":\"%s\",\"iterations\":%" PRIu64 "}\n",
+            system.machine, system.release, __VERSION__, iterations);
+
+    for (index = 0; index < sizeof(gBenchmarks) / sizeof(gBenchmarks[0]); index++) {
+        run_benchmark(&gBenchmarks[index], iterations, counter, syscallbias, results);
     }
 
-    fflush(stdout);
+    fclose(results);
+    return 0;
 }
 
+#endif
+
 int main(int argc, char** argv)
 {
+    int option;
+
+#ifdef CHIP_BENCHMARK
+    return run_benchmarks(argc, argv);
+#endif
+
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return run_query(argc, argv);
+    }
+
+    memset(gChartEnabled, true, sizeof(gChartEnabled));
+
+    if (read_config_file() < 0) {
+        return 1;
+    }
+
+    while ((option = getopt_long(argc, argv, "", gOptions, NULL)) != -1) {
+        if (option == '?' || apply_option(option, optarg) < 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
     // Parse the optional argument if supplied. It indicates the frequency (in
     // seconds) at which to emit new chart data. Valid values are 1-360.
 
-    if (argc >= 2) {
-        gUpdateEvery = atoi(argv[1]);
+    if (optind < argc) {
+        gUpdateEvery = atoi(argv[optind]);
         if (gUpdateEvery < 1 || gUpdateEvery > 360) {
-            fprintf(stderr, "Usage: %s [update_frequency]\n", argv[0]);
+            print_usage(argv[0]);
             return 1;
         }
     } else {
         gUpdateEvery = 1;
     }
 
-    // Connect to the I2C bus and ensure the ADC is enabled.
+    // Prefer the kernel drivers' sysfs attributes when they are there, unless
+    // the registers are simulated, recorded or replayed. Recordings hold raw
+    // register bytes, which the sysfs backend never reads.
 
-    gI2c = open("/dev/" I2C_DEVICE, O_RDWR);
-    if (gI2c < 0) {
-        fprintf(stderr, "Unable to open a handle to the I2C bus\n");
+    if (gBackend == BackendAuto) {
+        gBackend = gBus == &gI2cBackend && gReplayPath[0] == '\0' && gRecordPath[0] == '\0' && is_sysfs_available() ? BackendSysfs : BackendI2c;
+    }
+
+    if (gBackend == BackendSysfs && gRecordPath[0] != '\0') {
+        fprintf(stderr, "Recording requires the i2c backend\n");
+        return 1;
+    }
+
+    // Connect to the I2C bus and ensure the ADC is enabled, unless the data
+    // comes from a recording.
+
+    if (gReplayPath[0] == '\0' && gBackend == BackendI2c) {
+        if (gBus->Open() < 0) {
+            fprintf(stderr, "Unable to open a handle to the %s bus\n", gBus->Name);
+            return 1;
+        }
+
+        if (enable_adc() < 0) {
+            fprintf(stderr, "Unable to communicate with AXP209\n");
+            return 1;
+        }
+
+        gClearIrqStatus = access(AXP209_DRIVER, F_OK) < 0;
+    }
+
+    plan_reads();
+
+    if (gReplayPath[0] == '\0' && gBackend == BackendSysfs && open_sysfs_attributes() < 0) {
+        fprintf(stderr, "Unable to find the axp20x power supplies in " POWER_SUPPLY_DIRECTORY "\n");
         return 1;
     }
 
-    if (enable_adc() < 0) {
-        fprintf(stderr, "Unable to communicate with AXP209\n");
+    if (prepare_output() < 0) {
         return 1;
     }
 
@@ -409,40 +5447,60 @@ int main(int argc, char** argv)
 
     print_charts_preamble();
 
-    // Main loop: query and emit the values once per iteration.
-
-    struct timespec starttime, endtime;
-    uint64_t delta, starttimeus, endtimeus;
+    if (gReplayPath[0] != '\0') {
+        return replay_recording() < 0 ? 1 : 0;
+    }
 
-    endtimeus = 0;
+    print_functions_preamble();
 
-    while (true) {
-        clock_gettime(CLOCK_MONOTONIC, &starttime);
-        starttimeus = (uint64_t)(starttime.tv_sec * 1000000L + starttime.tv_nsec / 1000L);
+    if (gRecordPath[0] != '\0' && start_recording() < 0) {
+        fprintf(stderr, "Unable to record to %s\n", gRecordPath);
+        return 1;
+    }
 
-        // Calculate the time since the last frame in microseconds. This is
-        // passed to netdata on all but the first frame to provide an accurate
-        // collection time.
+    if (gExportPath[0] != '\0' && start_export() < 0) {
+        fprintf(stderr, "Unable to export to %s\n", gExportPath);
+        return 1;
+    }
 
-        if (endtimeus != 0) {
-            delta = starttimeus - endtimeus;
-        } else {
-            delta = 0;
-        }
+    if (gHistoryPath[0] != '\0' && open_series(&gHistory, gHistoryPath, false) < 0) {
+        fprintf(stderr, "Unable to keep the history in %s\n", gHistoryPath);
+        return 1;
+    }
 
-        gather_chart_data();
+    if (gStore.Directory[0] != '\0' && open_store() < 0) {
+        fprintf(stderr, "Unable to open the store in %s\n", gStore.Directory);
+        return 1;
+    }
 
-        print_chart_data(delta);
+    if (gLog.Path[0] != '\0' && start_log() < 0) {
+        fprintf(stderr, "Unable to log to %s\n", gLog.Path);
+        return 1;
+    }
 
-        // Sleep for a full frame, subtracting out the latency encountered
-        // while generating the current frame.
+    // Main loop: collect the values on every scheduler tick and queue them for
+    // the emitter thread, and answer netdata's commands in between.
 
-        clock_gettime(CLOCK_MONOTONIC, &endtime);
-        endtimeus = (uint64_t)(endtime.tv_sec * 1000000L + endtime.tv_nsec / 1000L);
+    if (create_event_loop(&gEventLoop) < 0 ||
+        start_scheduler(&gEventLoop) < 0 ||
+        (gOversampleRate > 0 && start_oversampling(&gEventLoop) < 0) ||
+        (gEventPollRate > 0 && start_event_polling(&gEventLoop) < 0) ||
+        listen_for_commands(&gEventLoop) < 0 ||
+        listen_for_signals(&gEventLoop) < 0) {
+        fprintf(stderr, "Unable to set up the event loop\n");
+        return 1;
+    }
 
-        delta = endtimeus - starttimeus;
-        usleep(gUpdateEvery * 1000000L - delta);
+    if (start_emitter() < 0 ||
+        add_event_source(&gEventLoop, gEmitter.Failure, EPOLLIN, on_emitter_failure, NULL) < 0) {
+        fprintf(stderr, "Unable to start the emitter thread\n");
+        return 1;
     }
 
+    run_event_loop(&gEventLoop);
+    stop_emitter();
+    flush_log(clock_ns(CLOCK_MONOTONIC));
+    stop_store();
+
     return 0;
 }